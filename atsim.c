@@ -0,0 +1,283 @@
+/*
+ * Copyright 2018 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <termios.h>
+
+#include "libet/libt.h"
+#include "common.h"
+
+#define NAME "atsim"
+#ifndef VERSION
+#define VERSION "<undefined version>"
+#endif
+
+#define ESTR(num)	strerror(num)
+
+/* program options */
+static const char help_msg[] =
+	NAME ": simulate a modem's AT command port on a pty\n"
+	"usage:	" NAME " [OPTIONS ...] LINK\n"
+	"\n"
+	"Options\n"
+	" -V, --version		Show version\n"
+	" -v, --verbose		Be more verbose\n"
+	"\n"
+	" -n, --urcs=NUM		Emit NUM '+CEER: t<NSEC>' URC's (default 0),\n"
+	"			with NSEC the realtime of creation\n"
+	" -r, --rate=RATE	Emit RATE URC's per second (default 1000)\n"
+	" -d, --delay=SECS	Start emitting after SECS (default 2)\n"
+	"\n"
+	"Arguments\n"
+	" LINK	Create symlink LINK to the pty\n"
+	;
+
+#ifdef _GNU_SOURCE
+static struct option long_opts[] = {
+	{ "help", no_argument, NULL, '?', },
+	{ "version", no_argument, NULL, 'V', },
+	{ "verbose", no_argument, NULL, 'v', },
+
+	{ "urcs", required_argument, NULL, 'n', },
+	{ "rate", required_argument, NULL, 'r', },
+	{ "delay", required_argument, NULL, 'd', },
+	{ },
+};
+#else
+#define getopt_long(argc, argv, optstring, longopts, longindex) \
+	getopt((argc), (argv), (optstring))
+#endif
+static const char optstring[] = "Vv?n:r:d:";
+
+/* signal handler */
+static volatile int sigterm;
+
+/* logging */
+static int loglevel = LOG_WARNING;
+
+/* program parameters */
+static int nurcs;
+static double rate = 1000;
+static double delay = 2;
+
+/* statistics */
+static unsigned long ncmds, nsent;
+
+static int master;
+
+static int mysignal(int signr, void (*fn)(int))
+{
+	struct sigaction sa = {
+		.sa_handler = fn,
+	};
+	return sigaction(signr, &sa, NULL);
+}
+static void onsigterm(int signr)
+{
+	sigterm = 1;
+}
+
+static void at_send(const char *str)
+{
+	int len = strlen(str), ret;
+
+	/* block when the pty is full, this throttles the URC storm */
+	for (; len; str += ret, len -= ret) {
+		ret = write(master, str, len);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret < 0)
+			mylog(LOG_ERR, "write pty: %s", ESTR(errno));
+	}
+}
+
+/* canned responses, enough for attomqtt to initialize */
+static const char *const responses[][2] = {
+	{ "at+cgmi", "ACME", },
+	{ "at+cgmm", "bench", },
+	{ "at+cgmr", "1.0", },
+	{ "at+cgsn", "123456789012345", },
+	{ "at+cpin?", "+CPIN: READY", },
+	{ "at+creg?", "+CREG: 0,1", },
+	{ "at+cgreg?", "+CGREG: 0,1", },
+	{ "at+cops?", "+COPS: 0,2,\"20601\",7", },
+	{ "at+csq", "+CSQ: 20,99", },
+	{ "at+cimi", "206011234567890", },
+	{ "at+ccid", "+CCID: 89320000000000000000", },
+	{ "at+cnum", "+CNUM: \"\",\"+32470000000\",145", },
+	{ "at+cspn?", "+CSPN: \"bench\",0", },
+	{ "at+copn", "+COPN: \"20601\",\"bench\"", },
+};
+
+static void at_recvd_cmd(char *cmd)
+{
+	int j;
+
+	++ncmds;
+	mylog(LOG_DEBUG, "< %s", cmd);
+	for (j = 0; j < sizeof(responses)/sizeof(responses[0]); ++j) {
+		if (!strcasecmp(cmd, responses[j][0])) {
+			at_send("\r\n");
+			at_send(responses[j][1]);
+			break;
+		}
+	}
+	at_send("\r\nOK\r\n");
+}
+
+static void at_recvd(void)
+{
+	static char buf[1024];
+	static int fill;
+	char *str, *cr;
+	int ret;
+
+	ret = read(master, buf+fill, sizeof(buf)-1-fill);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret < 0)
+		mylog(LOG_ERR, "read pty: %s", ESTR(errno));
+	fill += ret;
+	buf[fill] = 0;
+	for (str = buf; (cr = strpbrk(str, "\r\n")) != NULL; str = cr+1) {
+		*cr = 0;
+		if (*str)
+			at_recvd_cmd(str);
+	}
+	fill -= str - buf;
+	memmove(buf, str, fill);
+	if (fill >= sizeof(buf)-1)
+		/* garbage */
+		fill = 0;
+}
+
+static void urc_tick(void *dat)
+{
+	static double t0;
+	struct timespec ts;
+	char urc[64];
+	double now = mono_now();
+
+	if (!t0)
+		t0 = now;
+	/* pace on the clock, ticks may come late */
+	for (; nsent < (now - t0)*rate && nsent < nurcs; ++nsent) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		sprintf(urc, "\r\n+CEER: t%lli\r\n", ts.tv_sec*1000000000LL + ts.tv_nsec);
+		at_send(urc);
+	}
+	if (nsent < nurcs)
+		libt_add_timeout(0.001, urc_tick, dat);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, ret, slave;
+	const char *link, *slavename;
+	struct pollfd pf[1];
+	struct termios tio;
+
+	/* argument parsing */
+	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
+	switch (opt) {
+	case 'V':
+		fprintf(stderr, "%s %s\nCompiled on %s %s\n",
+				NAME, VERSION, __DATE__, __TIME__);
+		exit(0);
+	case 'v':
+		++loglevel;
+		break;
+	case 'n':
+		nurcs = strtoul(optarg, NULL, 0);
+		break;
+	case 'r':
+		rate = strtod(optarg, NULL);
+		break;
+	case 'd':
+		delay = strtod(optarg, NULL);
+		break;
+
+	default:
+		fprintf(stderr, "unknown option '%c'", opt);
+	case '?':
+		fputs(help_msg, stderr);
+		exit(1);
+		break;
+	}
+	if (optind >= argc) {
+		fputs(help_msg, stderr);
+		exit(1);
+	}
+	link = argv[optind];
+
+	setmylog(NAME, 0, LOG_LOCAL2, loglevel);
+	mysignal(SIGINT, onsigterm);
+	mysignal(SIGTERM, onsigterm);
+
+	master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (master < 0)
+		mylog(LOG_ERR, "posix_openpt: %s", ESTR(errno));
+	if (grantpt(master) < 0 || unlockpt(master) < 0)
+		mylog(LOG_ERR, "unlockpt: %s", ESTR(errno));
+	slavename = ptsname(master);
+	if (!slavename)
+		mylog(LOG_ERR, "ptsname: %s", ESTR(errno));
+	/* keep the slave open, so the master survives the client reopening it */
+	slave = open(slavename, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (slave < 0)
+		mylog(LOG_ERR, "open %s: %s", slavename, ESTR(errno));
+	if (tcgetattr(slave, &tio) < 0)
+		mylog(LOG_ERR, "tcgetattr %s: %s", slavename, ESTR(errno));
+	cfmakeraw(&tio);
+	if (tcsetattr(slave, TCSANOW, &tio) < 0)
+		mylog(LOG_ERR, "tcsetattr %s: %s", slavename, ESTR(errno));
+
+	unlink(link);
+	if (symlink(slavename, link) < 0)
+		mylog(LOG_ERR, "symlink %s: %s", link, ESTR(errno));
+
+	if (nurcs)
+		libt_add_timeout(delay, urc_tick, NULL);
+
+	pf[0].fd = master;
+	pf[0].events = POLLIN;
+
+	while (!sigterm) {
+		libt_flush();
+		ret = poll(pf, 1, libt_get_waittime());
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			mylog(LOG_ERR, "poll ...");
+		if (pf[0].revents)
+			at_recvd();
+	}
+	unlink(link);
+	printf("{\"cmds\":%lu,\"urcs\":%lu}\n", ncmds, nsent);
+	return 0;
+}
@@ -73,6 +73,9 @@ static const char help_msg[] =
 	"	detachedscan	Run scan when modem is not registered, i.e. detach before scan\n"
 	" -t, --trace=MODE	enable port traffice traces\n"
 	"			m (mqtt), s (stdout), l (syslog)\n"
+	" -s, --state=FILE	Keep the published state in FILE across restarts,\n"
+	"			and publish only the differences on startup.\n"
+	"			Remove FILE when the broker lost its retained topics\n"
 	"\n"
 	"Arguments\n"
 	" DEVICE	TTY device for modem\n"
@@ -94,13 +97,14 @@ static struct option long_opts[] = {
 
 	{ "options", required_argument, NULL, 'o', },
 	{ "trace", required_argument, NULL, 't', },
+	{ "state", required_argument, NULL, 's', },
 	{ },
 };
 #else
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?h:p:o:t:";
+static const char optstring[] = "Vv?h:p:o:t:s:";
 
 static char *const subopttable[] = {
 	"csq",
@@ -141,21 +145,17 @@ static int mqtt_keepalive = 10;
 static int mqtt_qos = -1;
 static char *mqtt_prefix;
 static int mqtt_prefix_len;
+static const char *statefile;
 
 /* utils */
 static struct mosquitto *mosq;
 static void mypublish(const char *bare_topic, const char *value, int retain);
 static int mypublish_change(const char *bare_topic, const char *value, int retain, char **saved);
+static void clear_topic(const char *topic);
 __attribute__((format(printf,1,2)))
 static const char *valuetostr(const char *fmt, ...);
 
 __attribute__((unused))
-static void myfree(void *dat)
-{
-	if (dat)
-		free(dat);
-}
-
 /* AT */
 static const char *atdev;
 static int atsock;
@@ -869,6 +869,9 @@ static void at_recvd(char *line)
 			curr_retry = 0;
 			/* remove head from queue */
 			free(pop_strq());
+			if (!strq)
+				/* initial sync done, drop stale topics */
+				snapshot_sweep(clear_topic);
 			/* issue next cmd to device */
 			at_next_cmd(NULL);
 
@@ -1032,12 +1035,32 @@ static void mypublish(const char *bare_topic, const char *value, int retain)
 
 	sprintf(topic, "%s%s", mqtt_prefix, bare_topic);
 
+	if (retain && !snapshot_update(topic, value))
+		/* broker has it already */
+		return;
 	/* publish cache */
 	ret = mosquitto_publish(mosq, NULL, topic, strlen(value ?: ""), value, mqtt_qos, retain);
 	if (ret)
 		mylog(LOG_ERR, "mosquitto_publish %s: %s", topic, mosquitto_strerror(ret));
 }
 
+static void clear_topic(const char *topic)
+{
+	int ret;
+
+	/* topic may carry an older prefix, so don't use mypublish */
+	ret = mosquitto_publish(mosq, NULL, topic, 0, NULL, mqtt_qos, 1);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_publish %s: %s", topic, mosquitto_strerror(ret));
+}
+
+/* rewrite the state file while running, for after a crash */
+static void save_state(void *dat)
+{
+	snapshot_save();
+	libt_add_timeout(SNAPSHOT_PERIOD, save_state, dat);
+}
+
 static void subscribe_topic(const char *topicfmt, ...)
 {
 	va_list va;
@@ -1068,6 +1091,7 @@ static void do_mqtt_maintenance(void *dat)
 int main(int argc, char *argv[])
 {
 	int opt, ret, not;
+	int statefile_loaded = 0;
 	char *str, *subopts, *savedstr;
 	char mqtt_name[32];
 	struct pollfd pf[3];
@@ -1103,6 +1127,9 @@ int main(int argc, char *argv[])
 	case 'p':
 		mqtt_prefix = optarg;
 		break;
+	case 's':
+		statefile = optarg;
+		break;
 
 	case 'o':
 		subopts = optarg;
@@ -1199,6 +1226,11 @@ int main(int argc, char *argv[])
 	tcflush(atsock, TCIOFLUSH);
 
 	/* MQTT start */
+	if (statefile && !snapshot_load(statefile))
+		/* the snapshot knows what the broker holds */
+		statefile_loaded = 1;
+	if (statefile)
+		libt_add_timeout(SNAPSHOT_PERIOD, save_state, NULL);
 	if (mqtt_qos < 0)
 		mqtt_qos = !strcmp(mqtt_host ?: "", "localhost") ? 0 : 1;
 	mosquitto_lib_init();
@@ -1260,27 +1292,29 @@ int main(int argc, char *argv[])
 	else
 		at_write2("at+cops?", 1);
 
-	/* clear potentially retained values in the broker */
-	mypublish("rssi", NULL, 1);
-	mypublish("ber", NULL, 1);
-	mypublish("op", NULL, 1);
-	mypublish("opid", NULL, 1);
-	mypublish("nt", NULL, 1);
-	mypublish("reg", NULL, 1);
-	mypublish("greg", NULL, 1);
-	mypublish("cellid", NULL, 1);
-	mypublish("lac", NULL, 1);
-	mypublish("imsi", NULL, 1);
-	mypublish("iccid", NULL, 1);
-	mypublish("number", NULL, 1);
-	mypublish("simop", NULL, 1);
-	mypublish("simopid", NULL, 1);
-	mypublish("brand", NULL, 1);
-	mypublish("model", NULL, 1);
-	mypublish("rev", NULL, 1);
-	mypublish("imei", NULL, 1);
-	/* make sure to remove any retained scan results, set retained */
-	mypublish("ops", "", 1);
+	if (!statefile_loaded) {
+		/* clear potentially retained values in the broker */
+		mypublish("rssi", NULL, 1);
+		mypublish("ber", NULL, 1);
+		mypublish("op", NULL, 1);
+		mypublish("opid", NULL, 1);
+		mypublish("nt", NULL, 1);
+		mypublish("reg", NULL, 1);
+		mypublish("greg", NULL, 1);
+		mypublish("cellid", NULL, 1);
+		mypublish("lac", NULL, 1);
+		mypublish("imsi", NULL, 1);
+		mypublish("iccid", NULL, 1);
+		mypublish("number", NULL, 1);
+		mypublish("simop", NULL, 1);
+		mypublish("simopid", NULL, 1);
+		mypublish("brand", NULL, 1);
+		mypublish("model", NULL, 1);
+		mypublish("rev", NULL, 1);
+		mypublish("imei", NULL, 1);
+		/* make sure to remove any retained scan results, set retained */
+		mypublish("ops", "", 1);
+	}
 
 	/* allow to cat all mqtt configs before starting */
 	send_self_sync(mosq, mqtt_qos);
@@ -1346,6 +1380,11 @@ int main(int argc, char *argv[])
 	}
 
 done:
+	if (statefile) {
+		/* leave the state in the broker */
+		snapshot_save();
+		goto terminate;
+	}
 	if (saved_rssi != 99)
 		/* clear rssi */
 		mypublish("rssi", NULL, 1);
@@ -1370,7 +1409,7 @@ done:
 	mypublish_change("imei", NULL, 1, &saved_imei);
 	mypublish("ops", "", 0);
 
-	/* terminate */
+terminate:
 	mqtt_ready = 0;
 	send_self_sync(mosq, mqtt_qos);
 	while (!mqtt_ready) {
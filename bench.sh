@@ -0,0 +1,92 @@
+#!/bin/sh
+# run each bridge against local stand-ins, with a private mosquitto broker:
+# wifitomqtt against wpasim, attomqtt against atsim on a pty,
+# and ifaddrtomqtt against a dummy interface (root only).
+# Each bridge produces 1 JSON line on stdout.
+#
+# Tune with environment variables
+# BENCH_PORT	broker TCP port (default 18830)
+# BENCH_EVENTS	events per bridge (default 5000)
+# BENCH_RATE	events per second (default 1000)
+# BENCH_ADDRS	addresses for ifaddrtomqtt (default 100)
+# BENCH_WIFIOPTS	extra wifitomqtt options, e.g. -b or -c.
+#		-n and -L hide BSSs, the benchmark would wait for them.
+
+PORT=${BENCH_PORT:-18830}
+EVENTS=${BENCH_EVENTS:-5000}
+RATE=${BENCH_RATE:-1000}
+ADDRS=${BENCH_ADDRS:-100}
+HOST=localhost:$PORT
+DIR=`mktemp -d /tmp/bench.XXXXXX`
+PIDS=
+
+stop() {
+	[ -n "$PIDS" ] || return
+	kill $PIDS 2>/dev/null
+	wait $PIDS 2>/dev/null
+	PIDS=
+}
+
+cleanup() {
+	stop
+	[ -n "$BROKER" ] && kill $BROKER 2>/dev/null
+	ip link del benchaddr0 2>/dev/null
+	rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+if ! command -v mosquitto >/dev/null; then
+	echo "bench: mosquitto broker not found" >&2
+	exit 1
+fi
+mosquitto -p $PORT >"$DIR/broker.log" 2>&1 &
+BROKER=$!
+sleep 0.5
+
+# wifitomqtt: BSS-ADDED storm, the SSID carries the timestamp
+# with -c, each BSS is 1 record in net/IFACE/bss/BSSID
+WIFITOPIC='net/bench0/bss/+/ssid'
+for opt in $BENCH_WIFIOPTS; do
+	case "$opt" in
+	--compact-bss)
+		WIFITOPIC='net/bench0/bss/+';;
+	--*)
+		;;
+	-*)
+		# the flags before the first option with an argument
+		case "${opt%%[hiHwmspCDnL]*}" in
+		*c*)
+			WIFITOPIC='net/bench0/bss/+';;
+		esac;;
+	esac
+done
+printf 'sleep 2\nstorm %i %s\nsleep 3600\n' $EVENTS $RATE > "$DIR/wpasim"
+./wpasim -C "$DIR" -i bench0 -n 0 "$DIR/wpasim" >/dev/null &
+PIDS="$PIDS $!"
+sleep 0.2
+./wifitomqtt -h $HOST -C "$DIR" -i bench0 $BENCH_WIFIOPTS &
+PIDS="$PIDS $!"
+./mqttbench -h $HOST -N wifitomqtt -p $! -n $EVENTS -t "$WIFITOPIC"
+stop
+
+# attomqtt: +CEER URC storm, published in warn
+./atsim -n $EVENTS -r $RATE -d 2 "$DIR/modem" >/dev/null &
+PIDS="$PIDS $!"
+sleep 0.2
+./attomqtt -h $HOST -p bench/at/ "$DIR/modem" &
+PIDS="$PIDS $!"
+./mqttbench -h $HOST -N attomqtt -p $! -n $EVENTS -t bench/at/warn
+stop
+
+# ifaddrtomqtt: addresses added on a dummy interface
+if [ "`id -u`" = 0 ] && ip link add benchaddr0 type dummy 2>/dev/null; then
+	ip link set benchaddr0 up
+	./ifaddrtomqtt -h $HOST &
+	PIDS="$PIDS $!"
+	./mqttbench -h $HOST -N ifaddrtomqtt -p $! -n $ADDRS -r 20 -a benchaddr0 -t net/benchaddr0/addr
+	stop
+	ip link del benchaddr0
+else
+	echo '{"bench":"ifaddrtomqtt","skipped":"needs root and dummy interfaces"}'
+fi
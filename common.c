@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -5,8 +6,10 @@
 #include <string.h>
 #include <time.h>
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <sys/stat.h>
 #include <mosquitto.h>
 
 #include "common.h"
@@ -61,6 +64,20 @@ done:
 		exit(1);
 }
 
+void myfree(void *dat)
+{
+	if (dat)
+		free(dat);
+}
+
+double mono_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
 /* self-sync util */
 static char myuuid[128];
 static const char selfsynctopic[] = "tmp/selfsync";
@@ -83,3 +100,439 @@ int is_self_sync(const struct mosquitto_message *msg)
 	return !strcmp(msg->topic, selfsynctopic) &&
 		!strcmp(myuuid, msg->payload ?: "");
 }
+
+/* hash index */
+static int hidx_slot(const struct hidx *h, unsigned int hash, int idx)
+{
+	int j, mask = h->size-1;
+
+	if (!h->size)
+		return -1;
+	for (j = hash & mask; h->slots[j].idx; j = (j+1) & mask) {
+		if (h->slots[j].hash == hash && h->slots[j].idx == idx+1)
+			return j;
+	}
+	return -1;
+}
+
+int hidx_find(const struct hidx *h, unsigned int hash,
+		int (*match)(int idx, const void *key), const void *key)
+{
+	int j, mask = h->size-1;
+
+	if (!h->size)
+		return -1;
+	for (j = hash & mask; h->slots[j].idx; j = (j+1) & mask) {
+		if (h->slots[j].hash == hash && match(h->slots[j].idx-1, key))
+			return h->slots[j].idx-1;
+	}
+	return -1;
+}
+
+static void hidx_insert(struct hidx *h, unsigned int hash, int idx)
+{
+	int j, mask = h->size-1;
+
+	for (j = hash & mask; h->slots[j].idx; j = (j+1) & mask);
+	h->slots[j].hash = hash;
+	h->slots[j].idx = idx+1;
+}
+
+void hidx_add(struct hidx *h, unsigned int hash, int idx)
+{
+	if ((h->used+1)*2 > h->size) {
+		/* grow, keep load factor below 1/2 */
+		struct hslot *old = h->slots;
+		int j, oldsize = h->size;
+
+		h->size = h->size ? h->size*2 : 64;
+		h->slots = calloc(h->size, sizeof(*h->slots));
+		if (!h->slots)
+			mylog(LOG_ERR, "calloc %i slots: %s", h->size, ESTR(errno));
+		for (j = 0; j < oldsize; ++j) {
+			if (old[j].idx)
+				hidx_insert(h, old[j].hash, old[j].idx-1);
+		}
+		free(old);
+	}
+	hidx_insert(h, hash, idx);
+	++h->used;
+}
+
+void hidx_remove(struct hidx *h, unsigned int hash, int idx)
+{
+	int i, j, home, mask = h->size-1;
+
+	i = hidx_slot(h, hash, idx);
+	if (i < 0)
+		return;
+	/* backward shift deletion, no tombstones needed */
+	for (j = i;;) {
+		j = (j+1) & mask;
+		if (!h->slots[j].idx)
+			break;
+		home = h->slots[j].hash & mask;
+		/* move j into the hole when its home is not within (i, j] */
+		if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+			h->slots[i] = h->slots[j];
+			i = j;
+		}
+	}
+	h->slots[i].idx = 0;
+	--h->used;
+}
+
+void hidx_renumber(struct hidx *h, unsigned int hash, int oldidx, int newidx)
+{
+	int j;
+
+	j = hidx_slot(h, hash, oldidx);
+	if (j >= 0)
+		h->slots[j].idx = newidx+1;
+}
+
+void hidx_free(struct hidx *h)
+{
+	free(h->slots);
+	h->slots = NULL;
+	h->size = h->used = 0;
+}
+
+unsigned int strhash(const char *str)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261u;
+
+	for (; *str; ++str)
+		hash = (hash ^ (unsigned char)*str) * 16777619u;
+	return hash;
+}
+
+unsigned int u64hash(unsigned long long val)
+{
+	/* fibonacci hashing, fold the upper bits into the result */
+	val *= 0x9e3779b97f4a7c15ull;
+	return val >> 32;
+}
+
+static inline int hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+int strtomac(const char *str, uint64_t *pmac)
+{
+	int j, hi, lo;
+	uint64_t mac = 0;
+
+	if (!str)
+		return -1;
+	/* 2 hex digits, then ':' or the end */
+	for (j = 0; j < 6; ++j, str += 3) {
+		hi = hexval(str[0]);
+		if (hi < 0)
+			return -1;
+		lo = hexval(str[1]);
+		if (lo < 0 || str[2] != ((j < 5) ? ':' : 0))
+			return -1;
+		mac = (mac << 8) | (hi << 4) | lo;
+	}
+	*pmac = mac;
+	return 0;
+}
+
+char *mactostr(uint64_t mac, char *buf)
+{
+	sprintf(buf, "%02x:%02x:%02x:%02x:%02x:%02x",
+			(int)(mac >> 40) & 0xff, (int)(mac >> 32) & 0xff,
+			(int)(mac >> 24) & 0xff, (int)(mac >> 16) & 0xff,
+			(int)(mac >> 8) & 0xff, (int)mac & 0xff);
+	return buf;
+}
+
+static inline const char *phash_name(const struct phash *ph, int idx)
+{
+	return *(const char *const *)((const char *)ph->table + idx*ph->stride);
+}
+
+static inline unsigned int phash_slot(unsigned int seed, const char *str, int len)
+{
+	/* FNV-1a, seeded */
+	unsigned int hash = 2166136261u ^ seed;
+
+	for (; len; --len, ++str)
+		hash = (hash ^ (unsigned char)*str) * 16777619u;
+	return (hash ^ (hash >> 16)) % PHASH_SIZE;
+}
+
+void phash_init(struct phash *ph, const void *table, int stride, int n)
+{
+	int j, slot;
+	const char *name;
+
+	if (n >= PHASH_SIZE)
+		mylog(LOG_ERR, "phash: %i names exceed %i slots", n, PHASH_SIZE);
+	ph->table = table;
+	ph->stride = stride;
+	ph->n = n;
+	for (ph->seed = 0; ph->seed < 100000; ++ph->seed) {
+		memset(ph->slots, 0, sizeof(ph->slots));
+		for (j = 0; j < n; ++j) {
+			name = phash_name(ph, j);
+			slot = phash_slot(ph->seed, name, strlen(name));
+			if (ph->slots[slot])
+				break;
+			ph->slots[slot] = j+1;
+		}
+		if (j >= n)
+			return;
+	}
+	mylog(LOG_ERR, "phash: no seed found for %i names", n);
+}
+
+int phash_find(const struct phash *ph, const char *str, int len)
+{
+	int idx = ph->slots[phash_slot(ph->seed, str, len)]-1;
+	const char *name;
+
+	if (idx < 0)
+		return -1;
+	name = phash_name(ph, idx);
+	if (strncmp(name, str, len) || name[len])
+		return -1;
+	return idx;
+}
+
+/* retained state snapshot */
+static struct snapent {
+	char *topic;
+	char *value;
+	int seen;
+} *snap;
+static int nsnap, ssnap;
+static struct hidx snapidx;
+static const char *snapfile;
+/* snap[] holds all retained topics known in the broker */
+static int snapcomplete;
+static int snapswept;
+/* snap[] differs from the file */
+static int snapdirty;
+
+static int snapmatch(int idx, const void *key)
+{
+	return !strcmp(snap[idx].topic, key);
+}
+
+static struct snapent *snap_add(const char *topic, const char *value)
+{
+	struct snapent *ent;
+
+	if (nsnap+1 > ssnap) {
+		ssnap += 16;
+		snap = realloc(snap, sizeof(*snap)*ssnap);
+		if (!snap)
+			mylog(LOG_ERR, "realloc %i snapshot: %s", ssnap, ESTR(errno));
+	}
+	ent = snap+nsnap;
+	ent->topic = strdup(topic);
+	ent->value = strdup(value);
+	ent->seen = 0;
+	hidx_add(&snapidx, strhash(topic), nsnap);
+	++nsnap;
+	snapdirty = 1;
+	return ent;
+}
+
+static void snap_remove(struct snapent *ent)
+{
+	int idx = ent - snap;
+
+	hidx_remove(&snapidx, strhash(ent->topic), idx);
+	snapdirty = 1;
+	free(ent->topic);
+	free(ent->value);
+	if (idx != --nsnap) {
+		/* fill the hole with the last entry */
+		*ent = snap[nsnap];
+		hidx_renumber(&snapidx, strhash(ent->topic), nsnap, idx);
+	}
+}
+
+int snapshot_load(const char *file)
+{
+	int fd, ret;
+	struct stat st;
+	char *dat, *topic, *value, *end;
+
+	snapfile = file;
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			mylog(LOG_WARNING, "open %s: %s", file, ESTR(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0)
+		mylog(LOG_ERR, "fstat %s: %s", file, ESTR(errno));
+	dat = malloc(st.st_size+1);
+	if (!dat)
+		mylog(LOG_ERR, "malloc %li: %s", (long)st.st_size, ESTR(errno));
+	ret = read(fd, dat, st.st_size);
+	close(fd);
+	if (ret != st.st_size) {
+		mylog(LOG_WARNING, "read %s: %s", file, ret < 0 ? ESTR(errno) : "short");
+		free(dat);
+		return -1;
+	}
+	dat[st.st_size] = 0;
+	end = dat+st.st_size;
+
+	/* nul-terminated topic & value pairs */
+	for (topic = dat; topic < end; topic = value+strlen(value)+1) {
+		value = topic+strlen(topic)+1;
+		if (value >= end)
+			break;
+		snap_add(topic, value);
+	}
+	free(dat);
+	snapcomplete = 1;
+	snapdirty = 0;
+	mylog(LOG_INFO, "loaded %i topics from %s", nsnap, file);
+	return 0;
+}
+
+int snapshot_update(const char *topic, const char *value)
+{
+	int idx;
+	struct snapent *ent;
+
+	if (!snapfile)
+		return 1;
+	value = value ?: "";
+	idx = hidx_find(&snapidx, strhash(topic), snapmatch, topic);
+	if (idx < 0) {
+		if (!*value)
+			/* absent already, if we know all topics */
+			return !snapcomplete;
+		snap_add(topic, value)->seen = 1;
+		return 1;
+	}
+	ent = snap+idx;
+	ent->seen = 1;
+	if (!strcmp(ent->value, value))
+		return 0;
+	if (!*value) {
+		snap_remove(ent);
+		return 1;
+	}
+	free(ent->value);
+	ent->value = strdup(value);
+	snapdirty = 1;
+	return 1;
+}
+
+void snapshot_sweep(void (*clear)(const char *topic))
+{
+	int j, n = 0;
+	char *topic;
+
+	if (!snapfile || snapswept)
+		return;
+	snapswept = 1;
+	/* go backwards, snap_remove() moves entries from the end */
+	for (j = nsnap-1; j >= 0; --j) {
+		if (snap[j].seen)
+			continue;
+		topic = strdup(snap[j].topic);
+		clear(topic);
+		if (j < nsnap && !snap[j].seen && !strcmp(snap[j].topic, topic))
+			/* clear() did not pass snapshot_update() */
+			snap_remove(snap+j);
+		free(topic);
+		++n;
+	}
+	snapcomplete = 1;
+	if (n)
+		mylog(LOG_INFO, "cleared %i stale topics", n);
+}
+
+int snapshot_save(void)
+{
+	int j, err;
+	FILE *fp;
+	char *tmp;
+
+	if (!snapfile || !snapdirty)
+		return 0;
+	/* write aside, rename is atomic */
+	if (asprintf(&tmp, "%s.tmp", snapfile) < 0)
+		mylog(LOG_ERR, "asprintf: %s", ESTR(errno));
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		mylog(LOG_WARNING, "open %s: %s", tmp, ESTR(errno));
+		goto failed;
+	}
+	for (j = 0; j < nsnap; ++j) {
+		fwrite(snap[j].topic, strlen(snap[j].topic)+1, 1, fp);
+		fwrite(snap[j].value, strlen(snap[j].value)+1, 1, fp);
+	}
+	err = ferror(fp);
+	if (fclose(fp) < 0 || err) {
+		mylog(LOG_WARNING, "write %s: %s", tmp, ESTR(errno));
+		goto failed_unlink;
+	}
+	if (rename(tmp, snapfile) < 0) {
+		mylog(LOG_WARNING, "rename %s: %s", snapfile, ESTR(errno));
+		goto failed_unlink;
+	}
+	free(tmp);
+	snapdirty = 0;
+	return 0;
+
+failed_unlink:
+	unlink(tmp);
+failed:
+	free(tmp);
+	return -1;
+}
+
+/* wpa_supplicant reply tokenizer */
+char *next_line(char **pos, char *end)
+{
+	char *line = *pos, *nl;
+
+	if (line >= end)
+		return NULL;
+	nl = memchr(line, '\n', end - line);
+	if (!nl)
+		nl = end;
+	*pos = nl+1;
+	if (nl > line && nl[-1] == '\r')
+		--nl;
+	*nl = 0;
+	return line;
+}
+
+int next_kv(char **pos, char *end, struct kv *kv)
+{
+	char *line, *eq;
+
+	while ((line = next_line(pos, end)) != NULL) {
+		eq = strchr(line, '=');
+		if (!eq || eq == line)
+			continue;
+		*eq = 0;
+		kv->key = line;
+		kv->keylen = eq - line;
+		kv->val = eq+1;
+		kv->vallen = strlen(kv->val);
+		/* lowercase, SIGNAL_POLL uses uppercase keys */
+		kv->hash = KVHASH(kv->keylen, tolower(line[0]), tolower(eq[-1]));
+		return 1;
+	}
+	return 0;
+}
@@ -1,5 +1,6 @@
 #ifndef _common_h_
 #define _common_h_
+#include <stdint.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -17,10 +18,101 @@ extern void mylog(int loglevel, const char *fmt, ...);
 extern void setmylog(const char *name, int options, int facility, int loglevel);
 extern void setmyloglevel(int level);
 
+/* free(), tolerating NULL */
+extern void myfree(void *dat);
+/* CLOCK_MONOTONIC in seconds */
+extern double mono_now(void);
+
 /* MQTT self-sync */
 extern void send_self_sync(struct mosquitto *, int qos);
 extern int is_self_sync(const struct mosquitto_message *);
 
+/* open-addressing hash index
+ * maps a hash onto an index in a table that the caller owns.
+ * Equal hashes are resolved with a match() callback.
+ */
+struct hidx {
+	struct hslot {
+		unsigned int hash;
+		int idx; /* table index +1, 0 means empty */
+	} *slots;
+	int size, used;
+};
+
+extern int hidx_find(const struct hidx *, unsigned int hash,
+		int (*match)(int idx, const void *key), const void *key);
+extern void hidx_add(struct hidx *, unsigned int hash, int idx);
+extern void hidx_remove(struct hidx *, unsigned int hash, int idx);
+extern void hidx_renumber(struct hidx *, unsigned int hash, int oldidx, int newidx);
+extern void hidx_free(struct hidx *);
+
+extern unsigned int strhash(const char *str);
+extern unsigned int u64hash(unsigned long long val);
+
+/* parse aa:bb:cc:dd:ee:ff, returns 0 on success */
+extern int strtomac(const char *str, uint64_t *pmac);
+/* format mac as aa:bb:cc:dd:ee:ff in buf of 18 bytes, returns buf */
+extern char *mactostr(uint64_t mac, char *buf);
+
+/* perfect hash
+ * maps a fixed table of names onto their index, without collisions.
+ * The seed is searched once at startup, by phash_init().
+ * Each table element must start with its const char *name.
+ */
+#define PHASH_SIZE	64
+struct phash {
+	const void *table;
+	int stride, n;
+	unsigned int seed;
+	unsigned char slots[PHASH_SIZE]; /* table index +1, 0 means empty */
+};
+
+extern void phash_init(struct phash *, const void *table, int stride, int n);
+/* find the first len characters of str, return -1 when absent */
+extern int phash_find(const struct phash *, const char *str, int len);
+
+/* zero-copy line & key=value tokenizer for wpa_supplicant replies
+ * Tokens point into the reply, and are nul-terminated in place.
+ */
+extern char *next_line(char **pos, char *end);
+
+struct kv {
+	char *key, *val;
+	int keylen, vallen;
+	/* KVHASH of key */
+	unsigned int hash;
+};
+
+/* perfect enough for the few keys of 1 reply,
+ * duplicate cases in 1 switch fail to compile,
+ * and the key is verified with KVIS anyway
+ */
+#define KVHASH(len, first, last)	(((len) << 16) | ((first) << 8) | (last))
+#define KVIS(kv, str)	((kv)->keylen == sizeof(str)-1 && !memcmp((kv)->key, (str), sizeof(str)-1))
+
+/* produce the next key=value line, only the first '=' separates,
+ * so values may contain '='. Lines without '=' are skipped.
+ */
+extern int next_kv(char **pos, char *end, struct kv *kv);
+
+/* retained state snapshot
+ * remembers the last published value of each retained topic,
+ * so a restart needs to publish only the differences.
+ * All functions are no-ops until snapshot_load() enabled it.
+ */
+/* returns 0 when a snapshot was loaded */
+extern int snapshot_load(const char *file);
+/* returns 0 when the broker holds this value already */
+extern int snapshot_update(const char *topic, const char *value);
+/* clear topics that were not published since load, once */
+extern void snapshot_sweep(void (*clear)(const char *topic));
+/* write the snapshot if it changed, atomically.
+ * Call it each SNAPSHOT_PERIOD, so a crash leaves a recent snapshot,
+ * and on exit.
+ */
+extern int snapshot_save(void);
+#define SNAPSHOT_PERIOD	10
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,311 @@
+/*
+ * Copyright 2018 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <syslog.h>
+
+#include "common.h"
+
+#define NAME "hidxbench"
+#ifndef VERSION
+#define VERSION "<undefined version>"
+#endif
+
+#define ESTR(num)	strerror(num)
+
+/* program options */
+static const char help_msg[] =
+	NAME ": compare the sorted BSS table with the hashed index\n"
+	"usage:	" NAME " [OPTIONS ...]\n"
+	"\n"
+	"Options\n"
+	" -V, --version		Show version\n"
+	" -v, --verbose		Be more verbose\n"
+	"\n"
+	" -n, --bss=NUM		Use NUM synthetic BSSs (default 1000)\n"
+	" -l, --loops=NUM	Look up all BSSs NUM times (default 100)\n"
+	"\n"
+	"Both tables are built, searched and emptied the way wifitomqtt\n"
+	"did before and after the hash index. The hash index is also\n"
+	"searched on the parsed MACs, as wifitomqtt does for BSS replies.\n"
+	"The results are verified, and the timing is printed as 1 JSON line\n"
+	;
+
+#ifdef _GNU_SOURCE
+static struct option long_opts[] = {
+	{ "help", no_argument, NULL, '?', },
+	{ "version", no_argument, NULL, 'V', },
+	{ "verbose", no_argument, NULL, 'v', },
+
+	{ "bss", required_argument, NULL, 'n', },
+	{ "loops", required_argument, NULL, 'l', },
+	{ },
+};
+#else
+#define getopt_long(argc, argv, optstring, longopts, longindex) \
+	getopt((argc), (argv), (optstring))
+#endif
+static const char optstring[] = "Vv?n:l:";
+
+/* logging */
+static int loglevel = LOG_WARNING;
+
+/* program parameters */
+static int nbss = 1000;
+static int nloops = 100;
+
+/* the BSS, as far as lookups are concerned */
+struct bss {
+	uint64_t mac;
+	char bssid[18];
+	int level;
+};
+
+static struct bss *bsss;
+static int nbsss;
+/* the bssids in random order, as wpa_supplicant reports them */
+static char (*keys)[18];
+/* the same, parsed */
+static uint64_t *macs;
+
+/* old: sorted on the textual bssid */
+static int bssidcmp(const void *a, const void *b)
+{
+	const struct bss *bssa = a, *bssb = b;
+
+	return strcmp(bssa->bssid, bssb->bssid);
+}
+
+static struct bss *old_find(const char *bssid)
+{
+	struct bss needle;
+
+	strcpy(needle.bssid, bssid);
+	return bsearch(&needle, bsss, nbsss, sizeof(*bsss), bssidcmp);
+}
+
+static void old_add(const char *bssid)
+{
+	struct bss *bss = &bsss[nbsss++];
+
+	memset(bss, 0, sizeof(*bss));
+	strcpy(bss->bssid, bssid);
+	qsort(bsss, nbsss, sizeof(*bsss), bssidcmp);
+}
+
+static void old_remove(struct bss *bss)
+{
+	int idx = bss - bsss;
+
+	if (idx != nbsss-1)
+		memmove(bss, bss+1, (nbsss-1-idx)*sizeof(*bsss));
+	--nbsss;
+}
+
+/* new: unsorted, via the hash index on the binary MAC */
+static struct hidx bssidx;
+
+static int bssmatch(int idx, const void *key)
+{
+	return bsss[idx].mac == *(const uint64_t *)key;
+}
+
+static struct bss *new_find_mac(uint64_t mac)
+{
+	int idx;
+
+	idx = hidx_find(&bssidx, u64hash(mac), bssmatch, &mac);
+	return (idx < 0) ? NULL : bsss+idx;
+}
+
+static struct bss *new_find(const char *bssid)
+{
+	uint64_t mac;
+
+	if (strtomac(bssid, &mac) < 0)
+		return NULL;
+	return new_find_mac(mac);
+}
+
+static void new_add(const char *bssid)
+{
+	struct bss *bss = &bsss[nbsss++];
+
+	memset(bss, 0, sizeof(*bss));
+	strtomac(bssid, &bss->mac);
+	strcpy(bss->bssid, bssid);
+	hidx_add(&bssidx, u64hash(bss->mac), bss - bsss);
+}
+
+static void new_remove(struct bss *bss)
+{
+	int idx = bss - bsss;
+
+	hidx_remove(&bssidx, u64hash(bss->mac), idx);
+	if (idx != nbsss-1) {
+		*bss = bsss[nbsss-1];
+		hidx_renumber(&bssidx, u64hash(bss->mac), nbsss-1, idx);
+	}
+	--nbsss;
+}
+
+/* run 1 implementation, return the number of mismatches
+ * find_mac, when present, looks up the parsed MACs
+ */
+static int run(struct bss *(*find)(const char *), void (*add)(const char *),
+		void (*remove)(struct bss *), struct bss *(*find_mac)(uint64_t),
+		double *times)
+{
+	double t0;
+	int j, k, nerr = 0;
+	struct bss *bss;
+
+	t0 = mono_now();
+	for (j = 0; j < nbss; ++j)
+		add(keys[j]);
+	times[0] = mono_now() - t0;
+
+	t0 = mono_now();
+	for (k = 0; k < nloops; ++k) {
+		for (j = 0; j < nbss; ++j) {
+			bss = find(keys[j]);
+			if (!bss || strcmp(bss->bssid, keys[j]))
+				++nerr;
+		}
+	}
+	times[1] = mono_now() - t0;
+
+	if (find_mac) {
+		t0 = mono_now();
+		for (k = 0; k < nloops; ++k) {
+			for (j = 0; j < nbss; ++j) {
+				bss = find_mac(macs[j]);
+				if (!bss || bss->mac != macs[j])
+					++nerr;
+			}
+		}
+		times[3] = mono_now() - t0;
+	}
+	/* absent BSSs */
+	if (find("02:ff:ff:ff:ff:ff"))
+		++nerr;
+
+	t0 = mono_now();
+	for (j = 0; j < nbss; ++j) {
+		bss = find(keys[j]);
+		if (!bss) {
+			++nerr;
+			continue;
+		}
+		remove(bss);
+		/* all others are still found */
+		if (j+1 < nbss && !find(keys[nbss-1]))
+			++nerr;
+	}
+	times[2] = mono_now() - t0;
+	if (nbsss)
+		++nerr;
+	return nerr;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, j, k, nerr;
+	double oldt[4], newt[4];
+
+	/* argument parsing */
+	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
+	switch (opt) {
+	case 'V':
+		fprintf(stderr, "%s %s\nCompiled on %s %s\n",
+				NAME, VERSION, __DATE__, __TIME__);
+		exit(0);
+	case 'v':
+		++loglevel;
+		break;
+	case 'n':
+		nbss = strtoul(optarg, NULL, 0);
+		break;
+	case 'l':
+		nloops = strtoul(optarg, NULL, 0);
+		break;
+
+	default:
+		fprintf(stderr, "unknown option '%c'", opt);
+	case '?':
+		fputs(help_msg, stderr);
+		exit(1);
+		break;
+	}
+	if (nbss < 1 || nloops < 1) {
+		fputs(help_msg, stderr);
+		exit(1);
+	}
+
+	setmylog(NAME, 0, LOG_LOCAL2, loglevel);
+
+	bsss = malloc(sizeof(*bsss)*nbss);
+	keys = malloc(sizeof(*keys)*nbss);
+	macs = malloc(sizeof(*macs)*nbss);
+	if (!bsss || !keys || !macs)
+		mylog(LOG_ERR, "malloc %i bsss: %s", nbss, ESTR(errno));
+	/* locally administered MACs of a few vendors, shuffled */
+	for (j = 0; j < nbss; ++j)
+		mactostr((uint64_t)(0x02 | ((j % 7) << 2)) << 40 |
+				0x1ca0000000ULL | (j & 0xffffff), keys[j]);
+	srand(1);
+	for (j = nbss-1; j > 0; --j) {
+		char tmp[18];
+
+		k = rand() % (j+1);
+		if (k == j)
+			continue;
+		memcpy(tmp, keys[j], sizeof(tmp));
+		memcpy(keys[j], keys[k], sizeof(tmp));
+		memcpy(keys[k], tmp, sizeof(tmp));
+	}
+	for (j = 0; j < nbss; ++j)
+		strtomac(keys[j], &macs[j]);
+
+	nerr = run(old_find, old_add, old_remove, NULL, oldt);
+	if (nerr)
+		mylog(LOG_ERR, "sorted table: %i mismatches", nerr);
+	nerr = run(new_find, new_add, new_remove, new_find_mac, newt);
+	if (nerr)
+		mylog(LOG_ERR, "hash index: %i mismatches", nerr);
+	hidx_free(&bssidx);
+
+	printf("{\"bench\":\"hidx\",\"bsss\":%i,\"loops\":%i,"
+			"\"old_add_us\":%.1f,\"new_add_us\":%.1f,"
+			"\"old_find_ns\":%.1f,\"new_find_ns\":%.1f,\"new_find_mac_ns\":%.1f,"
+			"\"old_remove_us\":%.1f,\"new_remove_us\":%.1f}\n",
+			nbss, nloops,
+			oldt[0]*1e6, newt[0]*1e6,
+			oldt[1]*1e9/nbss/nloops, newt[1]*1e9/nbss/nloops,
+			newt[3]*1e9/nbss/nloops,
+			oldt[2]*1e6, newt[2]*1e6);
+	free(bsss);
+	free(keys);
+	free(macs);
+	return 0;
+}
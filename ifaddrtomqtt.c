@@ -58,6 +58,9 @@ static const char help_msg[] =
 	"\n"
 	" -h, --host=HOST[:PORT]Specify alternate MQTT host+port\n"
 	" -a, --all		Emit link-local and lo addresses too\n"
+	" -s, --state=FILE	Keep the published state in FILE across restarts,\n"
+	"			and publish only the differences on startup.\n"
+	"			Remove FILE when the broker lost its retained topics\n"
 	;
 
 #ifdef _GNU_SOURCE
@@ -68,6 +71,7 @@ static struct option long_opts[] = {
 
 	{ "host", required_argument, NULL, 'h', },
 	{ "all", no_argument, NULL, 'a', },
+	{ "state", required_argument, NULL, 's', },
 
 	{ },
 };
@@ -75,9 +79,10 @@ static struct option long_opts[] = {
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?h:a";
+static const char optstring[] = "Vv?h:as:";
 
 static int emitall;
+static const char *statefile;
 
 /* signal handler */
 static volatile int sigterm;
@@ -110,12 +115,6 @@ static void onsigterm(int signr)
 	sigterm = 1;
 }
 
-static void myfree(void *dat)
-{
-	if (dat)
-		free(dat);
-}
-
 /* ADDR */
 struct iface {
 	char name[IFNAMSIZ+1];
@@ -202,12 +201,27 @@ static void publish_value(const char *value, const char *topicfmt, ...)
 	vsprintf(topic, topicfmt, va);
 	va_end(va);
 
+	if (!snapshot_update(topic, value))
+		/* broker has it already */
+		return;
 	/* publish cache */
 	ret = mosquitto_publish(mosq, NULL, topic, strlen(value ?: ""), value, mqtt_qos, 1);
 	if (ret)
 		mylog(LOG_ERR, "mosquitto_publish %s: %s", topic, mosquitto_strerror(ret));
 }
 
+static void clear_topic(const char *topic)
+{
+	publish_value("", "%s", topic);
+}
+
+/* rewrite the state file while running, for after a crash */
+static void save_state(void *dat)
+{
+	snapshot_save();
+	libt_add_timeout(SNAPSHOT_PERIOD, save_state, dat);
+}
+
 static const char *addrtostr(const struct sockaddr *addr)
 {
 	static char buf[1024];
@@ -332,6 +346,9 @@ int main(int argc, char *argv[])
 	case 'a':
 		emitall = 1;
 		break;
+	case 's':
+		statefile = optarg;
+		break;
 
 	default:
 		fprintf(stderr, "unknown option '%c'", opt);
@@ -345,6 +362,10 @@ int main(int argc, char *argv[])
 	mysignal(SIGINT, onsigterm);
 	mysignal(SIGTERM, onsigterm);
 
+	if (statefile) {
+		snapshot_load(statefile);
+		libt_add_timeout(SNAPSHOT_PERIOD, save_state, NULL);
+	}
 	/* MQTT start */
 	if (mqtt_qos < 0)
 		mqtt_qos = !strcmp(mqtt_host ?: "", "localhost") ? 0 : 1;
@@ -365,6 +386,8 @@ int main(int argc, char *argv[])
 	pf[0].events = POLL_IN;
 	/* fire first publish */
 	publish_addrs(NULL);
+	/* interfaces that disappeared meanwhile */
+	snapshot_sweep(clear_topic);
 
 	while (!sigterm) {
 		libt_flush();
@@ -395,9 +418,13 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	/* clean scan results in mqtt */
-	for (j = 0; j < nifaces; ++j)
-		publish_value("", "net/%s/addr", ifaces[j].name);
+	if (statefile)
+		/* leave the addresses in the broker */
+		snapshot_save();
+	else
+		/* clean scan results in mqtt */
+		for (j = 0; j < nifaces; ++j)
+			publish_value("", "net/%s/addr", ifaces[j].name);
 
 	/* terminate */
 	send_self_sync(mosq, mqtt_qos);
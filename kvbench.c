@@ -0,0 +1,414 @@
+/*
+ * Copyright 2018 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <syslog.h>
+
+#include "common.h"
+
+#define NAME "kvbench"
+#ifndef VERSION
+#define VERSION "<undefined version>"
+#endif
+
+#define ESTR(num)	strerror(num)
+
+/* program options */
+static const char help_msg[] =
+	NAME ": compare the wpa_supplicant reply parsers\n"
+	"usage:	" NAME " [OPTIONS ...]\n"
+	"\n"
+	"Options\n"
+	" -V, --version		Show version\n"
+	" -v, --verbose		Be more verbose\n"
+	"\n"
+	" -l, --loops=NUM	Parse each reply NUM times (default 100000)\n"
+	"\n"
+	"STATUS, BSS and SIGNAL_POLL replies are parsed with the strtok\n"
+	"loops that wifitomqtt used before, and with next_kv().\n"
+	"next_kv() must yield the expected values, the mismatches of the\n"
+	"strtok loops are counted. The timing is printed as 1 JSON line\n"
+	;
+
+#ifdef _GNU_SOURCE
+static struct option long_opts[] = {
+	{ "help", no_argument, NULL, '?', },
+	{ "version", no_argument, NULL, 'V', },
+	{ "verbose", no_argument, NULL, 'v', },
+
+	{ "loops", required_argument, NULL, 'l', },
+	{ },
+};
+#else
+#define getopt_long(argc, argv, optstring, longopts, longindex) \
+	getopt((argc), (argv), (optstring))
+#endif
+static const char optstring[] = "Vv?l:";
+
+/* logging */
+static int loglevel = LOG_WARNING;
+
+/* program parameters */
+static int nloops = 100000;
+
+/* what the wifitomqtt handlers pick from a reply */
+struct parsed {
+	const char *bssid, *ssid, *flags, *mode, *wpastate;
+	int id, freq, level, rssi, speed;
+};
+
+#define R_STATUS	0
+#define R_BSS		1
+#define R_SIGNAL_POLL	2
+
+/* replies as wpa_supplicant 2.9 returns them, with the expected values */
+static const struct reply {
+	const char *name;
+	int type;
+	const char *text;
+	struct parsed expect;
+} replies[] = {
+	{ "status", R_STATUS,
+		"bssid=f8:1a:67:2c:4e:10\n"
+		"freq=2437\n"
+		"ssid=home=net\n"
+		"id=0\n"
+		"mode=station\n"
+		"wifi_generation=4\n"
+		"pairwise_cipher=CCMP\n"
+		"group_cipher=CCMP\n"
+		"key_mgmt=WPA2-PSK\n"
+		"wpa_state=COMPLETED\n"
+		"ip_address=192.168.1.23\n"
+		"p2p_device_address=ba:27:eb:4a:10:7c\n"
+		"address=b8:27:eb:4a:10:7c\n"
+		"uuid=2b9c1d0e-5c3a-5f6e-8a1b-b827eb4a107c\n"
+		"ieee80211ac=0\n",
+		{ .bssid = "f8:1a:67:2c:4e:10", .ssid = "home=net", .mode = "station",
+		  .wpastate = "COMPLETED", .id = -1, .freq = 2437, },
+	},
+	{ "status-ap", R_STATUS,
+		"bssid[0]=b8:27:eb:4a:10:7c\n"
+		"ssid[0]=\n"
+		"num_sta[0]=2\n"
+		"bssid=b8:27:eb:4a:10:7c\n"
+		"freq=2412\n"
+		"ssid=myap\n"
+		"id=1\n"
+		"mode=AP\n"
+		"pairwise_cipher=CCMP\n"
+		"group_cipher=CCMP\n"
+		"key_mgmt=WPA2-PSK\n"
+		"wpa_state=COMPLETED\n"
+		"address=b8:27:eb:4a:10:7c\n",
+		{ .bssid = "b8:27:eb:4a:10:7c", .ssid = "myap", .mode = "AP",
+		  .wpastate = "COMPLETED", .id = -1, .freq = 2412, },
+	},
+	{ "bss", R_BSS,
+		"id=12\n"
+		"bssid=f8:1a:67:2c:4e:10\n"
+		"freq=2437\n"
+		"beacon_int=100\n"
+		"capabilities=0x0431\n"
+		"qual=0\n"
+		"noise=-89\n"
+		"level=-52\n"
+		"tsf=0000012489013862\n"
+		"age=3\n"
+		"ie=0008686f6d653d6e6574010882848b960c121824030106050400010000"
+		"2a01042f010430140100000fac040100000fac040100000fac020c00"
+		"32043048606c2d1aad0117ffff000000000000000000000000000000"
+		"00000000000000003d16060804000000000000000000000000000000"
+		"000000004a0e14000a002c01c800140005001900dd180050f2020101"
+		"800003a4000027a4000042435e0062322f00dd0900037f0101000"
+		"0ff7f\n"
+		"flags=[WPA2-PSK-CCMP][ESS]\n"
+		"ssid=home=net\n"
+		"snr=37\n"
+		"est_throughput=65000\n"
+		"update_idx=4213\n"
+		"beacon_ie=0008686f6d653d6e6574010882848b960c1218240301060504"
+		"00010000\n",
+		{ .bssid = "f8:1a:67:2c:4e:10", .ssid = "home=net",
+		  .flags = "[WPA2-PSK-CCMP][ESS]", .id = 12, .freq = 2437, .level = -52, },
+	},
+	{ "bss-open", R_BSS,
+		"id=40\n"
+		"bssid=02:1c:a0:00:00:07\n"
+		"freq=5180\n"
+		"beacon_int=100\n"
+		"capabilities=0x0001\n"
+		"qual=0\n"
+		"noise=-92\n"
+		"level=-81\n"
+		"tsf=0000000012345678\n"
+		"age=12\n"
+		"ie=00000301240504000100000706424520010d14\n"
+		"flags=\n"
+		"ssid=\n"
+		"snr=11\n"
+		"est_throughput=6000\n"
+		"update_idx=4240\n",
+		{ .bssid = "02:1c:a0:00:00:07", .ssid = "", .flags = "",
+		  .id = 40, .freq = 5180, .level = -81, },
+	},
+	{ "signal_poll", R_SIGNAL_POLL,
+		"RSSI=-52\n"
+		"LINKSPEED=65\n"
+		"NOISE=9999\n"
+		"FREQUENCY=2437\n"
+		"WIDTH=20 MHz\n"
+		"CENTER_FRQ1=2437\n"
+		"AVG_RSSI=-53\n"
+		"AVG_BEACON_RSSI=-52\n",
+		{ .id = -1, .rssi = -52, .speed = 65, },
+	},
+};
+#define NREPLIES	(sizeof(replies)/sizeof(replies[0]))
+
+/* the strtok loops of old */
+static void old_parse(int type, char *line, struct parsed *p)
+{
+	char *tok, *val, *saveptr;
+
+	for (line = strtok_r(line, "\r\n", &saveptr); line;
+			line = strtok_r(NULL, "\r\n", &saveptr)) {
+		tok = strtok(line, "=");
+		val = strtok(NULL, "=");
+		switch (type) {
+		case R_STATUS:
+			if (!strcmp(tok, "bssid"))
+				p->bssid = val;
+			else if (!strcmp(tok, "ssid"))
+				p->ssid = val;
+			else if (!strcmp(tok, "freq"))
+				p->freq = strtoul(val, NULL, 0);
+			else if (!strcmp(tok, "mode"))
+				p->mode = val;
+			else if (!strcmp(tok, "wpa_state"))
+				p->wpastate = val;
+			break;
+		case R_BSS:
+			if (!strcmp(tok, "bssid"))
+				p->bssid = val;
+			else if (!strcmp(tok, "id"))
+				p->id = strtoul(val ?: "-1", NULL, 0);
+			else if (!strcmp(tok, "freq"))
+				p->freq = strtoul(val, NULL, 0);
+			else if (!strcmp(tok, "level"))
+				p->level = strtol(val, NULL, 0);
+			else if (!strcmp(tok, "flags"))
+				p->flags = val;
+			else if (!strcmp(tok, "ssid"))
+				p->ssid = val;
+			break;
+		case R_SIGNAL_POLL:
+			if (!strcasecmp(tok, "rssi"))
+				p->rssi = strtol(val, NULL, 0);
+			else if (!strcasecmp(tok, "linkspeed"))
+				p->speed = strtol(val, NULL, 0);
+			break;
+		}
+	}
+}
+
+/* next_kv, with the switches of the wifitomqtt handlers */
+static void new_parse(int type, char *line, char *end, struct parsed *p)
+{
+	struct kv kv;
+
+	while (next_kv(&line, end, &kv))
+	switch (type) {
+	case R_STATUS:
+		switch (kv.hash) {
+		case KVHASH(5, 'b', 'd'):
+			if (KVIS(&kv, "bssid"))
+				p->bssid = kv.val;
+			break;
+		case KVHASH(4, 's', 'd'):
+			if (KVIS(&kv, "ssid"))
+				p->ssid = kv.val;
+			break;
+		case KVHASH(4, 'f', 'q'):
+			if (KVIS(&kv, "freq"))
+				p->freq = strtoul(kv.val, NULL, 0);
+			break;
+		case KVHASH(4, 'm', 'e'):
+			if (KVIS(&kv, "mode"))
+				p->mode = kv.val;
+			break;
+		case KVHASH(9, 'w', 'e'):
+			if (KVIS(&kv, "wpa_state"))
+				p->wpastate = kv.val;
+			break;
+		}
+		break;
+	case R_BSS:
+		switch (kv.hash) {
+		case KVHASH(5, 'b', 'd'):
+			if (KVIS(&kv, "bssid"))
+				p->bssid = kv.val;
+			break;
+		case KVHASH(2, 'i', 'd'):
+			if (KVIS(&kv, "id"))
+				p->id = strtoul(kv.val, NULL, 0);
+			break;
+		case KVHASH(4, 'f', 'q'):
+			if (KVIS(&kv, "freq"))
+				p->freq = strtoul(kv.val, NULL, 0);
+			break;
+		case KVHASH(5, 'l', 'l'):
+			if (KVIS(&kv, "level"))
+				p->level = strtol(kv.val, NULL, 0);
+			break;
+		case KVHASH(5, 'f', 's'):
+			if (KVIS(&kv, "flags"))
+				p->flags = kv.val;
+			break;
+		case KVHASH(4, 's', 'd'):
+			if (KVIS(&kv, "ssid"))
+				p->ssid = kv.val;
+			break;
+		}
+		break;
+	case R_SIGNAL_POLL:
+		switch (kv.hash) {
+		case KVHASH(4, 'r', 'i'):
+			if (KVIS(&kv, "RSSI"))
+				p->rssi = strtol(kv.val, NULL, 0);
+			break;
+		case KVHASH(9, 'l', 'd'):
+			if (KVIS(&kv, "LINKSPEED"))
+				p->speed = strtol(kv.val, NULL, 0);
+			break;
+		}
+		break;
+	}
+}
+
+static int strdiffers(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a != b;
+	return strcmp(a, b);
+}
+
+/* return the number of differing values */
+static int compare(const struct reply *r, const struct parsed *p, const char *how)
+{
+	const struct parsed *e = &r->expect;
+	int nerr;
+
+	nerr = strdiffers(p->bssid, e->bssid) + strdiffers(p->ssid, e->ssid) +
+		strdiffers(p->flags, e->flags) + strdiffers(p->mode, e->mode) +
+		strdiffers(p->wpastate, e->wpastate) +
+		(p->id != e->id) + (p->freq != e->freq) + (p->level != e->level) +
+		(p->rssi != e->rssi) + (p->speed != e->speed);
+	if (nerr)
+		mylog(LOG_INFO, "%s %s: %i values differ, ssid '%s' flags '%s'",
+				how, r->name, nerr, p->ssid ?: "(null)", p->flags ?: "(null)");
+	return nerr;
+}
+
+static void clear_parsed(struct parsed *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->id = -1;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, j, k, len, oldmismatch = 0, newmismatch = 0;
+	double t0, oldt = 0, newt = 0;
+	static char buf[4096];
+	struct parsed p;
+	const struct reply *r;
+
+	/* argument parsing */
+	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
+	switch (opt) {
+	case 'V':
+		fprintf(stderr, "%s %s\nCompiled on %s %s\n",
+				NAME, VERSION, __DATE__, __TIME__);
+		exit(0);
+	case 'v':
+		++loglevel;
+		break;
+	case 'l':
+		nloops = strtoul(optarg, NULL, 0);
+		break;
+
+	default:
+		fprintf(stderr, "unknown option '%c'", opt);
+	case '?':
+		fputs(help_msg, stderr);
+		exit(1);
+		break;
+	}
+	if (nloops < 1) {
+		fputs(help_msg, stderr);
+		exit(1);
+	}
+
+	setmylog(NAME, 0, LOG_LOCAL2, loglevel);
+
+	for (r = replies; r < replies+NREPLIES; ++r) {
+		len = strlen(r->text);
+		if (len >= sizeof(buf))
+			mylog(LOG_ERR, "reply %s too long", r->name);
+
+		/* both parse in place, so each loop parses a fresh copy */
+		clear_parsed(&p);
+		memcpy(buf, r->text, len+1);
+		old_parse(r->type, buf, &p);
+		oldmismatch += !!compare(r, &p, "strtok");
+		t0 = mono_now();
+		for (k = 0; k < nloops; ++k) {
+			clear_parsed(&p);
+			memcpy(buf, r->text, len+1);
+			old_parse(r->type, buf, &p);
+		}
+		oldt += mono_now() - t0;
+
+		clear_parsed(&p);
+		memcpy(buf, r->text, len+1);
+		new_parse(r->type, buf, buf+len, &p);
+		newmismatch += !!compare(r, &p, "next_kv");
+		t0 = mono_now();
+		for (k = 0; k < nloops; ++k) {
+			clear_parsed(&p);
+			memcpy(buf, r->text, len+1);
+			new_parse(r->type, buf, buf+len, &p);
+		}
+		newt += mono_now() - t0;
+	}
+	if (newmismatch)
+		mylog(LOG_ERR, "next_kv: %i replies parsed wrong", newmismatch);
+
+	j = NREPLIES;
+	printf("{\"bench\":\"kv\",\"replies\":%i,\"loops\":%i,"
+			"\"old_ns_per_reply\":%.1f,\"new_ns_per_reply\":%.1f,"
+			"\"old_wrong_replies\":%i}\n",
+			j, nloops, oldt*1e9/j/nloops, newt*1e9/j/nloops, oldmismatch);
+	return 0;
+}
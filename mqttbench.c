@@ -0,0 +1,506 @@
+/*
+ * Copyright 2018 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <syslog.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <mosquitto.h>
+
+#include "libet/libt.h"
+#include "common.h"
+
+#define NAME "mqttbench"
+#ifndef VERSION
+#define VERSION "<undefined version>"
+#endif
+
+#define ESTR(num)	strerror(num)
+
+/* program options */
+static const char help_msg[] =
+	NAME ": measure latency & throughput of MQTT bridges\n"
+	"usage:	" NAME " [OPTIONS ...] -t TOPIC [-t TOPIC ...]\n"
+	"\n"
+	"Messages are timed with a t<NSEC> word in the payload,\n"
+	"the CLOCK_REALTIME when the device event was generated.\n"
+	"\n"
+	"Options\n"
+	" -V, --version		Show version\n"
+	" -v, --verbose		Be more verbose\n"
+	"\n"
+	" -h, --host=HOST[:PORT]Specify alternate MQTT host+port\n"
+	" -t, --topic=TOPIC	Subscribe to TOPIC\n"
+	" -N, --name=NAME	Label the results with NAME\n"
+	" -n, --count=NUM	Stop after NUM events (default 1000)\n"
+	" -w, --idle=SECS	Stop after SECS without events (default 10)\n"
+	" -p, --pid=PID		Measure CPU & memory of process PID\n"
+	" -a, --addr=IFACE	Generate the events by adding ipv4 addresses to IFACE,\n"
+	"			and time the addresses in the payload instead\n"
+	" -r, --rate=RATE	Add RATE addresses per second (default 20)\n"
+	;
+
+#ifdef _GNU_SOURCE
+static struct option long_opts[] = {
+	{ "help", no_argument, NULL, '?', },
+	{ "version", no_argument, NULL, 'V', },
+	{ "verbose", no_argument, NULL, 'v', },
+
+	{ "host", required_argument, NULL, 'h', },
+	{ "topic", required_argument, NULL, 't', },
+	{ "name", required_argument, NULL, 'N', },
+	{ "count", required_argument, NULL, 'n', },
+	{ "idle", required_argument, NULL, 'w', },
+	{ "pid", required_argument, NULL, 'p', },
+	{ "addr", required_argument, NULL, 'a', },
+	{ "rate", required_argument, NULL, 'r', },
+	{ },
+};
+#else
+#define getopt_long(argc, argv, optstring, longopts, longindex) \
+	getopt((argc), (argv), (optstring))
+#endif
+static const char optstring[] = "Vv?h:t:N:n:w:p:a:r:";
+
+/* signal handler */
+static volatile int sigterm;
+
+/* logging */
+static int loglevel = LOG_WARNING;
+
+/* MQTT parameters */
+static const char *mqtt_host = "localhost";
+static int mqtt_port = 1883;
+static int mqtt_keepalive = 10;
+static struct mosquitto *mosq;
+
+/* program parameters */
+static const char *name = NAME;
+static int count = 1000;
+static double idle = 10;
+static int pid;
+
+static int mysignal(int signr, void (*fn)(int))
+{
+	struct sigaction sa = {
+		.sa_handler = fn,
+	};
+	return sigaction(signr, &sa, NULL);
+}
+static void onsigterm(int signr)
+{
+	sigterm = 1;
+}
+
+static int64_t nsnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* latency samples, in nsec */
+static int64_t *samples;
+static int nsamples, ssamples;
+static int64_t tfirst, tlast;
+
+/* process measurement */
+static unsigned long cpu0;
+
+static unsigned long proc_cputicks(void)
+{
+	char buf[1024], *str;
+	unsigned long utime = 0, stime = 0;
+	FILE *fp;
+	int ret;
+
+	sprintf(buf, "/proc/%i/stat", pid);
+	fp = fopen(buf, "r");
+	if (!fp)
+		return 0;
+	ret = fread(buf, 1, sizeof(buf)-1, fp);
+	fclose(fp);
+	buf[ret > 0 ? ret : 0] = 0;
+	/* skip pid & comm, comm may contain spaces */
+	str = strrchr(buf, ')');
+	if (str)
+		sscanf(str+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+				&utime, &stime);
+	return utime + stime;
+}
+
+static long proc_status_kb(const char *key)
+{
+	char line[256];
+	FILE *fp;
+	long value = 0;
+	int len = strlen(key);
+
+	sprintf(line, "/proc/%i/status", pid);
+	fp = fopen(line, "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, key, len) && line[len] == ':') {
+			value = strtol(line+len+1, NULL, 10);
+			break;
+		}
+	}
+	fclose(fp);
+	return value;
+}
+
+static void stop(void *dat)
+{
+	sigterm = 1;
+}
+
+static void add_sample(int64_t sent, int64_t now)
+{
+	if (nsamples+1 > ssamples) {
+		ssamples += 1024;
+		samples = realloc(samples, sizeof(*samples)*ssamples);
+		if (!samples)
+			mylog(LOG_ERR, "realloc %i samples: %s", ssamples, ESTR(errno));
+	}
+	if (!nsamples) {
+		tfirst = now;
+		if (pid)
+			cpu0 = proc_cputicks();
+	}
+	tlast = now;
+	samples[nsamples++] = now - sent;
+	if (nsamples >= count)
+		sigterm = 1;
+	else
+		libt_add_timeout(idle, stop, NULL);
+}
+
+static int cmpsample(const void *a, const void *b)
+{
+	const int64_t *sa = a, *sb = b;
+
+	return (*sa > *sb) - (*sa < *sb);
+}
+
+static double percentile_us(int pct)
+{
+	int idx;
+
+	if (!nsamples)
+		return 0;
+	idx = (nsamples*pct + 99)/100 - 1;
+	if (idx < 0)
+		idx = 0;
+	return samples[idx]/1e3;
+}
+
+static void print_results(void)
+{
+	double secs = (tlast - tfirst)/1e9;
+	double cpu_us = 0;
+
+	qsort(samples, nsamples, sizeof(*samples), cmpsample);
+	if (pid && nsamples)
+		cpu_us = (proc_cputicks() - cpu0)*1e6/sysconf(_SC_CLK_TCK);
+
+	printf("{\"bench\":\"%s\",\"events\":%i,\"events_per_s\":%.1f,"
+			"\"p50_us\":%.0f,\"p99_us\":%.0f,\"max_us\":%.0f",
+			name, nsamples, (secs > 0) ? (nsamples-1)/secs : 0,
+			percentile_us(50), percentile_us(99), percentile_us(100));
+	if (pid)
+		printf(",\"cpu_us_per_event\":%.1f,\"rss_kb\":%li,\"hwm_kb\":%li",
+				nsamples ? cpu_us/nsamples : 0,
+				proc_status_kb("VmRSS"), proc_status_kb("VmHWM"));
+	printf("}\n");
+	fflush(stdout);
+}
+
+/* address generation */
+static int nlsock = -1;
+static int ifindex;
+static double rate = 20;
+static int64_t *addrsent;
+static int naddrsent;
+
+static void add_addr(int idx)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ifaddrmsg ifa;
+		char attrbuf[64];
+	} req = {
+		.nh = {
+			.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg)),
+			.nlmsg_type = RTM_NEWADDR,
+			.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL,
+			.nlmsg_seq = idx,
+		},
+		.ifa = {
+			.ifa_family = AF_INET,
+			.ifa_prefixlen = 32,
+			.ifa_index = ifindex,
+		},
+	};
+	static const int types[] = { IFA_LOCAL, IFA_ADDRESS, };
+	struct rtattr *rta;
+	uint32_t addr = htonl((10 << 24) | (77 << 16) | idx);
+	int j;
+
+	for (j = 0; j < sizeof(types)/sizeof(types[0]); ++j) {
+		rta = (struct rtattr *)(((char *)&req) + NLMSG_ALIGN(req.nh.nlmsg_len));
+		rta->rta_type = types[j];
+		rta->rta_len = RTA_LENGTH(sizeof(addr));
+		memcpy(RTA_DATA(rta), &addr, sizeof(addr));
+		req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + RTA_LENGTH(sizeof(addr));
+	}
+	addrsent[idx] = nsnow();
+	if (send(nlsock, &req, req.nh.nlmsg_len, 0) < 0)
+		mylog(LOG_ERR, "add address 10.77.%i.%i: %s", idx >> 8, idx & 0xff, ESTR(errno));
+}
+
+static void addr_tick(void *dat)
+{
+	static double t0;
+	double now = mono_now();
+
+	if (!t0)
+		t0 = now;
+	/* pace on the clock, ticks may come late */
+	while (naddrsent < (now - t0)*rate && naddrsent < count)
+		add_addr(naddrsent++);
+	if (naddrsent < count)
+		libt_add_timeout(0.001, addr_tick, dat);
+}
+
+static void time_addrs(char *payload)
+{
+	char *tok, *endp;
+	int64_t now = nsnow();
+	int idx;
+
+	for (tok = strtok(payload, " "); tok; tok = strtok(NULL, " ")) {
+		if (strncmp(tok, "10.77.", 6))
+			continue;
+		idx = strtoul(tok+6, &endp, 10) << 8;
+		idx |= strtoul(endp+1, NULL, 10);
+		if (idx >= naddrsent || !addrsent[idx])
+			continue;
+		add_sample(addrsent[idx], now);
+		/* count each address only once */
+		addrsent[idx] = 0;
+	}
+}
+
+static void time_stamps(char *payload)
+{
+	char *str;
+	int64_t now = nsnow();
+
+	for (str = payload; (str = strchr(str, 't')) != NULL; ++str) {
+		/* t<NSEC> must be a word on its own */
+		if (str > payload && !isspace(str[-1]))
+			continue;
+		if (!isdigit(str[1]))
+			continue;
+		add_sample(strtoll(str+1, NULL, 10), now);
+		return;
+	}
+}
+
+static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitto_message *msg)
+{
+	static char *payload;
+	static int spayload;
+
+	if (msg->payloadlen+1 > spayload) {
+		spayload = (msg->payloadlen+1+255) & ~255;
+		payload = realloc(payload, spayload);
+		if (!payload)
+			mylog(LOG_ERR, "realloc %i: %s", spayload, ESTR(errno));
+	}
+	memcpy(payload, msg->payload, msg->payloadlen);
+	payload[msg->payloadlen] = 0;
+
+	if (nlsock >= 0)
+		time_addrs(payload);
+	else
+		time_stamps(payload);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, ret;
+	char *str;
+	char mqtt_name[32];
+	struct pollfd pf[1];
+	const char *addr_iface = NULL;
+	char **topics = NULL;
+	int ntopics = 0, j;
+
+	/* argument parsing */
+	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
+	switch (opt) {
+	case 'V':
+		fprintf(stderr, "%s %s\nCompiled on %s %s\n",
+				NAME, VERSION, __DATE__, __TIME__);
+		exit(0);
+	case 'v':
+		++loglevel;
+		break;
+	case 'h':
+		mqtt_host = optarg;
+		str = strrchr(optarg, ':');
+		if (str > mqtt_host && *(str-1) != ']') {
+			/* TCP port provided */
+			*str = 0;
+			mqtt_port = strtoul(str+1, NULL, 10);
+		}
+		break;
+	case 't':
+		topics = realloc(topics, sizeof(*topics)*(ntopics+1));
+		if (!topics)
+			mylog(LOG_ERR, "realloc topics: %s", ESTR(errno));
+		topics[ntopics++] = optarg;
+		break;
+	case 'N':
+		name = optarg;
+		break;
+	case 'n':
+		count = strtoul(optarg, NULL, 0);
+		break;
+	case 'w':
+		idle = strtod(optarg, NULL);
+		break;
+	case 'p':
+		pid = strtoul(optarg, NULL, 0);
+		break;
+	case 'a':
+		addr_iface = optarg;
+		break;
+	case 'r':
+		rate = strtod(optarg, NULL);
+		break;
+
+	default:
+		fprintf(stderr, "unknown option '%c'", opt);
+	case '?':
+		fputs(help_msg, stderr);
+		exit(1);
+		break;
+	}
+	if (!ntopics) {
+		fputs(help_msg, stderr);
+		exit(1);
+	}
+
+	setmylog(NAME, 0, LOG_LOCAL2, loglevel);
+	mysignal(SIGINT, onsigterm);
+	mysignal(SIGTERM, onsigterm);
+
+	if (addr_iface) {
+		struct sockaddr_nl local = {
+			.nl_family = AF_NETLINK,
+		};
+
+		if (count > 0xffff)
+			/* 10.77.0.0/16 */
+			count = 0xffff;
+		ifindex = if_nametoindex(addr_iface);
+		if (!ifindex)
+			mylog(LOG_ERR, "iface %s: %s", addr_iface, ESTR(errno));
+		nlsock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+		if (nlsock < 0)
+			mylog(LOG_ERR, "socket netlink: %s", ESTR(errno));
+		if (bind(nlsock, (struct sockaddr *)&local, sizeof(local)) < 0)
+			mylog(LOG_ERR, "bind netlink: %s", ESTR(errno));
+		addrsent = calloc(count, sizeof(*addrsent));
+		if (!addrsent)
+			mylog(LOG_ERR, "calloc %i: %s", count, ESTR(errno));
+		/* give the subscriptions some time */
+		libt_add_timeout(1, addr_tick, NULL);
+	}
+
+	/* MQTT start */
+	mosquitto_lib_init();
+	sprintf(mqtt_name, "%s-%i", NAME, getpid());
+	mosq = mosquitto_new(mqtt_name, true, NULL);
+	if (!mosq)
+		mylog(LOG_ERR, "mosquitto_new failed: %s", ESTR(errno));
+
+	ret = mosquitto_connect(mosq, mqtt_host, mqtt_port, mqtt_keepalive);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_connect %s:%i: %s", mqtt_host, mqtt_port, mosquitto_strerror(ret));
+	mosquitto_message_callback_set(mosq, my_mqtt_msg);
+	for (j = 0; j < ntopics; ++j) {
+		ret = mosquitto_subscribe(mosq, NULL, topics[j], 0);
+		if (ret)
+			mylog(LOG_ERR, "mosquitto_subscribe %s: %s", topics[j], mosquitto_strerror(ret));
+	}
+	libt_add_timeout(idle, stop, NULL);
+
+	/* prepare poll */
+	pf[0].fd = mosquitto_socket(mosq);
+	pf[0].events = POLL_IN;
+
+	while (!sigterm) {
+		libt_flush();
+		if (sigterm)
+			break;
+		ret = poll(pf, 1, libt_get_waittime());
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			mylog(LOG_ERR, "poll ...");
+		if (pf[0].revents) {
+			/* mqtt read ... */
+			ret = mosquitto_loop_read(mosq, 1);
+			if (ret) {
+				mylog(LOG_WARNING, "mosquitto_loop_read: %s", mosquitto_strerror(ret));
+				break;
+			}
+		}
+		/* mosquitto things to do each iteration */
+		ret = mosquitto_loop_misc(mosq);
+		if (ret) {
+			mylog(LOG_WARNING, "mosquitto_loop_misc: %s", mosquitto_strerror(ret));
+			break;
+		}
+		if (mosquitto_want_write(mosq)) {
+			ret = mosquitto_loop_write(mosq, 1);
+			if (ret) {
+				mylog(LOG_WARNING, "mosquitto_loop_write: %s", mosquitto_strerror(ret));
+			}
+		}
+	}
+	print_results();
+	return !nsamples;
+}
@@ -14,8 +14,8 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -37,7 +37,10 @@
 #include <sys/un.h>
 #include <mosquitto.h>
 #ifdef NOPLAINPSK
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <openssl/evp.h>
+#include <openssl/sha.h>
 #endif
 
 #include "libet/libt.h"
@@ -61,9 +64,37 @@ static const char help_msg[] =
 	"\n"
 	" -h, --host=HOST[:PORT]Specify alternate MQTT host+port\n"
 	" -i, --iface=IFACE	Control IFACE (default: wlan0)\n"
+	"			Repeat -i, or separate with a comma,\n"
+	"			to serve several interfaces in 1 process\n"
 	" -S, --no-ap-bgscan	Emit empty bgscan for AP/Mesh networks\n"
 	"			This avoids warnings on devices that cannot scan\n"
 	"			while in AP/mesh mode\n"
+	" -b, --bulk-bss		Refresh the scan table with ranged BSS requests\n"
+	"			instead of 1 BSS request per scan result\n"
+	" -c, --compact-bss	Publish 1 record per BSS in net/IFACE/bss/BSSID\n"
+	"			instead of seperate freq, level, flags & ssid topics\n"
+	" -t, --bss-table	Publish the complete scan table in net/IFACE/bsstable\n"
+	" -n, --top=N		Publish only the N strongest BSSs\n"
+	" -L, --min-level=DBM	Publish only BSSs with a level of at least DBM\n"
+	" -H, --hysteresis=TOPIC=DB[,MIN[,MAX]]\n"
+	"			Publish TOPIC only when it changed at least DB,\n"
+	"			and no sooner than MIN seconds after the last publish.\n"
+	"			Smaller changes are published after MAX seconds.\n"
+	"			TOPIC is bsslevel, level, rssi, speed or all\n"
+	" -w, --save-delay=SECS	Merge config changes during SECS into 1 SAVE_CONFIG\n"
+	"			(default 1)\n"
+	" -m, --signal-monitor=DBM[,HYST]\n"
+	"			Follow rssi via SIGNAL_MONITOR events around threshold DBM\n"
+	"			with HYST hysteresis (default 4), instead of polling\n"
+	" -s, --state=FILE	Keep the published state in FILE across restarts,\n"
+	"			and publish only the differences on startup.\n"
+	"			Remove FILE when the broker lost its retained topics\n"
+	" -p, --sta-poll=SECS	Publish signal, connected time & traffic of AP stations\n"
+	"			in net/IFACE/sta/MAC/..., refreshed each SECS\n"
+	" -C, --ctrl-dir=DIR	Find the wpa_supplicant socket in DIR\n"
+	"			(default /var/run/wpa_supplicant)\n"
+	" -D, --diag=SECS	Publish per command queue wait & round trip histograms\n"
+	"			in net/IFACE/diag/cmd/VERB each SECS\n"
 	"\n"
 	"Arguments\n"
 	" FILE|DEVICE	Read input from FILE or DEVICE\n"
@@ -79,13 +110,25 @@ static struct option long_opts[] = {
 	{ "iface", required_argument, NULL, 'i', },
 
 	{ "no-ap-bgscan", no_argument, NULL, 'S', },
+	{ "bulk-bss", no_argument, NULL, 'b', },
+	{ "compact-bss", no_argument, NULL, 'c', },
+	{ "bss-table", no_argument, NULL, 't', },
+	{ "top", required_argument, NULL, 'n', },
+	{ "min-level", required_argument, NULL, 'L', },
+	{ "hysteresis", required_argument, NULL, 'H', },
+	{ "save-delay", required_argument, NULL, 'w', },
+	{ "signal-monitor", required_argument, NULL, 'm', },
+	{ "state", required_argument, NULL, 's', },
+	{ "sta-poll", required_argument, NULL, 'p', },
+	{ "ctrl-dir", required_argument, NULL, 'C', },
+	{ "diag", required_argument, NULL, 'D', },
 	{ },
 };
 #else
 #define getopt_long(argc, argv, optstring, longopts, longindex) \
 	getopt((argc), (argv), (optstring))
 #endif
-static const char optstring[] = "Vv?h:i:S";
+static const char optstring[] = "Vv?h:i:Sbctn:L:H:w:m:s:p:C:D:";
 
 /* signal handler */
 static volatile int sigterm;
@@ -103,77 +146,787 @@ static int mqtt_qos = -1;
 /* state */
 static struct mosquitto *mosq;
 static void publish_value(const char *value, const char *topic);
-static void publish_ivalue_if_different(const char *newvalue, int *saved, const char *topic);
+static void publish_hyst(int type, int newvalue);
+static void set_hyst(int type, int newvalue);
+static void clear_hyst(int type);
+static void publish_svalue_if_different(const char *newvalue, char **saved, const char *topic);
 __attribute__((format(printf,1,2)))
 static void publish_failure(const char *valuefmt, ...);
+static void publish_diag(const char *name, const char *value);
 __attribute__((format(printf,1,2)))
 static const char *valuetostr(const char *fmt, ...);
 __attribute__((format(printf,1,2)))
 static const char *topicfmt(const char *fmt, ...);
 
 /* WPA */
-static const char *iface = "wlan0";
-static int wpasock;
-static int have_bss_events;
-static int wpa_lost;
-static int curr_mode;
-static char curr_bssid[20];
-static int curr_level;
+static const char *ctrl_dir = "/var/run/wpa_supplicant";
 static int noapbgscan;
-static int saved_rssi;
-static int saved_speed;
+static int bulkbss;
+static int sigmon;
+static int sigmon_threshold;
+static int sigmon_hysteresis = 4;
+static double keepalive_delay = 5;
+static double save_delay = 1;
+static int compactbss;
+static int bsstable;
+/* publish only a ranked subset of the BSSs */
+static int bssranked;
+static int bsstop;
+static int bssminlevel = INT_MIN;
+static const char *statefile;
+static double sta_poll_delay;
+
+/* hysteresis for noisy values */
+struct hyst {
+	int deadband;
+	double mininterval;
+	double maxstale;
+};
+
+#define HY_BSSLEVEL	0
+#define HY_LEVEL	1
+#define HY_RSSI		2
+#define HY_SPEED	3
+#define NHYST		4
+static const char *const hystnames[NHYST] = {
+	[HY_BSSLEVEL] = "bsslevel",
+	[HY_LEVEL] = "level",
+	[HY_RSSI] = "rssi",
+	[HY_SPEED] = "speed",
+};
+static struct hyst hysts[NHYST];
+
+/* a noisy value of an interface, in net/IFACE/<hystname> */
+struct hystval {
+	int value;
+	int published;
+	/* time of the last publish */
+	double t;
+	/* a newer value, held back by the hysteresis */
+	int held;
+	int holding;
+};
 
-static void myfree(void *dat)
+static int parse_hysteresis(char *str)
 {
-	if (dat)
-		free(dat);
+	struct hyst hy = {};
+	char *name;
+	int j, found = 0;
+
+	name = strtok(str, "=");
+	hy.deadband = strtoul(strtok(NULL, ",") ?: "0", NULL, 0);
+	hy.mininterval = strtod(strtok(NULL, ",") ?: "0", NULL);
+	hy.maxstale = strtod(strtok(NULL, ",") ?: "0", NULL);
+
+	for (j = 0; j < NHYST; ++j) {
+		if (!strcmp(name ?: "", "all") || !strcmp(name ?: "", hystnames[j])) {
+			hysts[j] = hy;
+			found = 1;
+		}
+	}
+	return found ? 0 : -1;
+}
+
+/* test if newvalue may replace saved, published at savedt */
+static int hyst_pass(int type, int saved, double savedt, int newvalue, double now)
+{
+	const struct hyst *hy = &hysts[type];
+
+	if (hy->mininterval && now - savedt < hy->mininterval)
+		return 0;
+	if (abs(newvalue - saved) < hy->deadband &&
+			!(hy->maxstale && now - savedt >= hy->maxstale))
+		return 0;
+	return 1;
+}
+
+/* test if a new BSS level should be published,
+ * and update the saved value if so.
+ */
+static int hyst_changed(int type, int *saved, double *savedt, int newvalue)
+{
+	double now;
+
+	if (newvalue == *saved)
+		return 0;
+	now = mono_now();
+	if (!hyst_pass(type, *saved, *savedt, newvalue, now))
+		return 0;
+	*saved = newvalue;
+	*savedt = now;
+	return 1;
+}
+
+/* WPA commands, per verb */
+#define CMD_IDEMPOTENT	0x01 /* queries, identical queued ones merge */
+#define CMD_MUTATION	0x02 /* changes the config */
+static const struct cmdverb {
+	const char *name;
+	int flags;
+} cmdverbs[] = {
+	{ "BSS", CMD_IDEMPOTENT, },
+	{ "STATUS", CMD_IDEMPOTENT, },
+	{ "SCAN_RESULTS", CMD_IDEMPOTENT, },
+	{ "SIGNAL_POLL", CMD_IDEMPOTENT, },
+	{ "LIST_NETWORKS", CMD_IDEMPOTENT, },
+	{ "GET_NETWORK", CMD_IDEMPOTENT, },
+	{ "SET_NETWORK", CMD_MUTATION, },
+	{ "ADD_NETWORK", CMD_MUTATION, },
+	{ "ENABLE_NETWORK", CMD_MUTATION, },
+	{ "DISABLE_NETWORK", CMD_MUTATION, },
+	{ "SELECT_NETWORK", CMD_MUTATION, },
+	{ "REMOVE_NETWORK", CMD_MUTATION, },
+	{ "SAVE_CONFIG", 0, },
+	{ "STA", CMD_IDEMPOTENT, },
+	{ "STA-FIRST", 0, },
+	{ "STA-NEXT", 0, },
+	{ "PING", CMD_IDEMPOTENT, },
+	{ "ATTACH", 0, },
+	{ "SCAN", 0, },
+	{ "SET", 0, },
+	{ "SIGNAL_MONITOR", 0, },
+	/* the last one collects all others */
+	{ "other", 0, },
+};
+#define NCMDVERBS	(sizeof(cmdverbs)/sizeof(cmdverbs[0]))
+
+static struct phash cmdverb_hash;
+
+static int cmdverb(const char *cmd)
+{
+	int j = phash_find(&cmdverb_hash, cmd, strcspn(cmd, " "));
+
+	/* the last one collects all others */
+	return (j < 0) ? NCMDVERBS-1 : j;
 }
 
-/* WPA */
 struct str {
 	struct str *next;
-	char a[1];
+	/* next in cmdhash bucket */
+	struct str *hnext;
+	unsigned int hash;
+	/* index in cmdverbs */
+	int verb;
+	int lane;
+	int flags;
+#define SF_SCANREQ	0x01 /* SCAN requested via MQTT, or its SCAN_RESULTS */
+	/* enqueued & sent times */
+	double tqueued, tsent;
+	/* the command, in buf, or on the heap when it did not fit */
+	char *a;
+	char buf[128];
+};
+
+/* command slots are recycled, and never returned to the heap.
+ * Lanes & merging release slots out of order, so a free list
+ * is used rather than a ring.
+ */
+#define STR_CHUNK	32
+static struct str *freestrs;
+static int nstrs, nfreestrs;
+/* heap allocations of the command queue, for diagnostics */
+static int nstr_allocs;
+
+static void put_str(struct str *str)
+{
+	if (str->a != str->buf)
+		free(str->a);
+	str->a = str->buf;
+	str->next = freestrs;
+	freestrs = str;
+	++nfreestrs;
+}
+
+static struct str *get_str(void)
+{
+	struct str *str;
+	int j;
+
+	if (!freestrs) {
+		/* grow, slots must not move */
+		str = malloc(sizeof(*str)*STR_CHUNK);
+		if (!str)
+			mylog(LOG_ERR, "malloc %i strs: %s", STR_CHUNK, ESTR(errno));
+		++nstr_allocs;
+		nstrs += STR_CHUNK;
+		for (j = 0; j < STR_CHUNK; ++j) {
+			str[j].a = str[j].buf;
+			put_str(str+j);
+		}
+	}
+	str = freestrs;
+	freestrs = str->next;
+	--nfreestrs;
+	return str;
+}
+
+/* commands not sent yet, per lane.
+ * Interactive commands overtake the bulk refreshes
+ */
+#define LANE_INTERACTIVE	0
+#define LANE_BULK		1
+#define NLANES			2
+struct lane {
+	struct str *head, *last;
+};
+
+#define NCMDHASH	1024
+
+/* log2 buckets in usec: bucket 0 is < 1usec, bucket N < 2^N usec */
+#define NTIMEBUCKETS	24
+
+struct cmdtiming {
+	int n;
+	int wait[NTIMEBUCKETS];
+	int rtt[NTIMEBUCKETS];
+};
+
+/* connection attempt phases, in order */
+#define CP_SELECT	0 /* SELECT_NETWORK sent */
+#define CP_AUTH		1 /* SME: Trying to authenticate */
+#define CP_ASSOC	2 /* Trying to associate */
+#define CP_ASSOCIATED	3 /* Associated with */
+#define CP_HANDSHAKE	4 /* WPA: Key negotiation completed */
+#define CP_CONNECTED	5 /* CTRL-EVENT-CONNECTED */
+#define CP_STATUS	6 /* STATUS COMPLETED published */
+#define NCONNPHASES	7
+/* rolling window of successful connections */
+#define NCONNHIST	64
+
+/* heap of bsss[] indices, ordered on level */
+struct bssheap {
+	int *idx;
+	int n, s;
+	int max; /* strongest on top, weakest otherwise */
+};
+
+/* per interface state
+ * wif is the interface being served, the poll loop, the timers
+ * and the MQTT callback switch it before handling an interface.
+ */
+struct wif {
+	const char *iface;
+	int wpasock;
+	/* wpa_supplicant state is re-synced once per (re)connection */
+	int wpa_synced;
+	int have_bss_events;
+	int curr_mode;
+	char curr_bssid[20];
+	int bss_bulk_busy;
+	/* level, rssi & speed */
+	struct hystval hyst[NHYST];
+	char *saved_bssid, *saved_freq, *saved_ssid;
+	const char *real_wifi_state;
+	const char *pub_wifi_state;
+	int selectedmode; /* selected wpa_supplicant mode */
+
+	/* commands sent, waiting for their reply in order */
+	struct str *strq, *strqlast;
+	int ninflight;
+	struct lane lanes[NLANES];
+	struct str *cmdhash[NCMDHASH];
+	int ncmds_merged;
+	/* queued or in flight config changes */
+	int npending_mutations;
+	struct cmdtiming cmdtimings[NCMDVERBS];
+	double last_reply;
+	int ntruncated;
+
+	struct ssident *ssids;
+	int nssids, sssids;
+	int freessid;
+	struct hidx ssididx;
+
+	/* incrementing counter to distinguish the order of network creation */
+	int netcreateseq;
+	struct network *networks;
+	int nnetworks, snetworks;
+	int last_ap_id;
+	int last_mesh_id;
+	struct unnamed *unnamed;
+	int nunnamed, sunnamed;
+	int save_pending;
+	int nsave_requests, nsaves;
+
+	struct bss *bsss;
+	int nbsss, sbsss;
+	struct hidx bssidx;
+	/* with -n or -L: the published BSSs with the weakest on top,
+	 * and the hidden BSSs with the strongest on top
+	 */
+	struct bssheap bssshown, bsshidden;
+	/* aggregated scan table */
+	int bsstable_dirty;
+	/* scan requested via MQTT and accepted, reported when done */
+	int scan_accepted;
+	double scan_t0, scan_time;
+	/* connection attempt timeline, 0 for phases not reached */
+	double conn_t[NCONNPHASES];
+	int conn_active, conn_retries;
+	char conn_bssid[20];
+	/* msec spent per phase of the last NCONNHIST connections, -1 if skipped,
+	 * and the total in the last slot
+	 */
+	float conn_hist[NCONNHIST][NCONNPHASES+1];
+	int nconn_hist, conn_histpos, nconn_failed;
+
+	struct sta *stas;
+	int nstas, sstas;
+	struct hidx staidx;
 };
 
-static struct str *strq, *strqlast;
+static struct wif *wifs;
+static int nwifs, swifs;
+static struct wif *wif;
+static int state_swept;
 
-static void add_strq(const char *a)
+static void add_wif(const char *iface)
+{
+	struct wif *w;
+
+	if (nwifs+1 > swifs) {
+		swifs += 16;
+		wifs = realloc(wifs, sizeof(*wifs)*swifs);
+		if (!wifs)
+			mylog(LOG_ERR, "realloc %i wifs: %s", swifs, ESTR(errno));
+	}
+	w = &wifs[nwifs++];
+	memset(w, 0, sizeof(*w));
+	w->iface = iface;
+	w->wpasock = -1;
+	w->selectedmode = -1;
+	w->freessid = -1;
+	w->last_ap_id = -1;
+	w->last_mesh_id = -1;
+	w->bsshidden.max = 1;
+}
+
+static struct wif *find_wif(const char *iface)
+{
+	int j;
+
+	for (j = 0; j < nwifs; ++j)
+		if (!strcmp(wifs[j].iface, iface))
+			return wifs+j;
+	return NULL;
+}
+
+/* limit the commands in flight, a queued interactive command
+ * then waits for at most WPA_WINDOW replies
+ */
+#define WPA_WINDOW	4
+
+/* walk all commands, in flight or queued */
+#define for_each_pending_cmd(str, lane) \
+	for (lane = -1; lane < NLANES; ++lane) \
+		for (str = (lane < 0) ? wif->strq : wif->lanes[lane].head; str; str = str->next)
+
+/* queued idempotent commands, hashed.
+ * Commands in flight are not merged, since their reply
+ * may predate the event that requests it again.
+ */
+static struct str *find_queued_cmd(const char *a, unsigned int hash)
 {
 	struct str *str;
 
-	str = malloc(sizeof(*str)+strlen(a));
-	if (!str)
-		mylog(LOG_ERR, "malloc str: %s", ESTR(errno));
-	strcpy(str->a, a);
+	for (str = wif->cmdhash[hash % NCMDHASH]; str; str = str->hnext)
+		if (str->hash == hash && !strcmp(str->a, a))
+			return str;
+	return NULL;
+}
+
+static void unhash_cmd(struct str *str)
+{
+	struct str **pstr;
+
+	if (!(cmdverbs[str->verb].flags & CMD_IDEMPOTENT))
+		return;
+	for (pstr = &wif->cmdhash[str->hash % NCMDHASH]; *pstr; pstr = &(*pstr)->hnext) {
+		if (*pstr == str) {
+			*pstr = str->hnext;
+			break;
+		}
+	}
+}
+
+/* forget a queued command that was never answered */
+static void drop_cmd(struct str *str)
+{
+	unhash_cmd(str);
+	if (cmdverbs[str->verb].flags & CMD_MUTATION)
+		--wif->npending_mutations;
+	put_str(str);
+}
 
+static void append_str(struct str **head, struct str **last, struct str *str)
+{
 	/* linked list */
-	if (strqlast)
-		strqlast->next = str;
+	if (*last)
+		(*last)->next = str;
 	else
-		strq = str;
-	strqlast = str;
+		*head = str;
+	*last = str;
 	str->next = NULL;
 }
 
+static struct str *pop_str(struct str **head, struct str **last)
+{
+	struct str *str;
+
+	str = *head;
+	if (str)
+		*head = str->next;
+	if (!*head)
+		*last = NULL;
+	return str;
+}
+
 static struct str *pop_strq(void)
 {
 	struct str *head;
 
-	head = strq;
-	if (head)
-		strq = strq->next;
-	if (!strq)
-		strqlast = NULL;
+	head = pop_str(&wif->strq, &wif->strqlast);
+	if (!head)
+		return NULL;
+	--wif->ninflight;
+	if (cmdverbs[head->verb].flags & CMD_MUTATION)
+		--wif->npending_mutations;
 	return head;
 }
 
+static void flush_lanes(void)
+{
+	struct str *str;
+	int j;
+
+	for (j = 0; j < NLANES; ++j) {
+		while (wif->lanes[j].head) {
+			str = pop_str(&wif->lanes[j].head, &wif->lanes[j].last);
+			drop_cmd(str);
+		}
+	}
+}
+
+/* command timing, per verb */
+
+static double diag_delay;
+
+static int timebucket(double secs)
+{
+	unsigned long usec = (secs > 0) ? secs*1e6 : 0;
+	int bucket;
+
+	for (bucket = 0; usec && bucket < NTIMEBUCKETS-1; usec >>= 1)
+		++bucket;
+	return bucket;
+}
+
+/* account a command whose reply just arrived */
+static void cmd_timing(const struct str *str)
+{
+	struct cmdtiming *timing = wif->cmdtimings+str->verb;
+	double now = mono_now();
+	/* wpa_supplicant serves the commands in order,
+	 * so a command waits for the previous reply too
+	 */
+	double start = (str->tsent > wif->last_reply) ? str->tsent : wif->last_reply;
+
+	++timing->n;
+	++timing->wait[timebucket(start - str->tqueued)];
+	++timing->rtt[timebucket(now - start)];
+	wif->last_reply = now;
+}
+
+/* upper bound in usec of the pct percentile */
+static long hist_percentile(const int *hist, int n, int pct)
+{
+	int j, sum, limit = (n*pct + 99)/100;
+
+	for (j = sum = 0; j < NTIMEBUCKETS-1; ++j) {
+		sum += hist[j];
+		if (sum >= limit)
+			break;
+	}
+	return 1L << j;
+}
+
+static const char *hist_str(const int *hist)
+{
+	static char buf[NTIMEBUCKETS*12];
+	char *str = buf;
+	int j, last;
+
+	for (last = NTIMEBUCKETS-1; last > 0 && !hist[last]; --last);
+	for (j = 0; j <= last; ++j)
+		str += sprintf(str, "%s%i", j ? ":" : "", hist[j]);
+	return buf;
+}
+
+static void publish_cmd_timing(void *dat)
+{
+	struct cmdtiming *timing;
+	char value[NTIMEBUCKETS*12*2+128];
+	int j, len;
+
+	wif = dat;
+	for (j = 0; j < NCMDVERBS; ++j) {
+		timing = wif->cmdtimings+j;
+		if (!timing->n)
+			continue;
+		len = sprintf(value, "n=%i wait50=%li wait99=%li rtt50=%li rtt99=%li",
+				timing->n,
+				hist_percentile(timing->wait, timing->n, 50),
+				hist_percentile(timing->wait, timing->n, 99),
+				hist_percentile(timing->rtt, timing->n, 50),
+				hist_percentile(timing->rtt, timing->n, 99));
+		len += sprintf(value+len, " wait=%s", hist_str(timing->wait));
+		sprintf(value+len, " rtt=%s", hist_str(timing->rtt));
+		publish_diag(valuetostr("cmd/%s", cmdverbs[j].name), value);
+		memset(timing, 0, sizeof(*timing));
+	}
+	publish_diag("cmd/pool", valuetostr("slots=%i free=%i allocs=%i",
+				nstrs, nfreestrs, nstr_allocs));
+	if (wif->ncmds_merged) {
+		publish_diag("cmd/merged", valuetostr("%i", wif->ncmds_merged));
+		wif->ncmds_merged = 0;
+	}
+	libt_add_timeout(diag_delay, publish_cmd_timing, dat);
+}
+
+/* connection timeline */
+#define CONN_TIMEOUT	60
+
+static const char *const connphases[NCONNPHASES] = {
+	[CP_SELECT] = "select",
+	[CP_AUTH] = "auth",
+	[CP_ASSOC] = "assoc",
+	[CP_ASSOCIATED] = "associated",
+	[CP_HANDSHAKE] = "handshake",
+	[CP_CONNECTED] = "connected",
+	[CP_STATUS] = "status",
+};
+
+static int floatcmp(const void *a, const void *b)
+{
+	float fa = *(const float *)a, fb = *(const float *)b;
+
+	return (fa > fb) - (fa < fb);
+}
+
+/* publish the percentiles in msec of each phase over the window */
+static void publish_conn_stats(void)
+{
+	float vals[NCONNHIST];
+	char value[128];
+	int j, k, n;
+
+	for (k = 0; k <= NCONNPHASES; ++k) {
+		for (j = n = 0; j < wif->nconn_hist; ++j) {
+			if (wif->conn_hist[j][k] >= 0)
+				vals[n++] = wif->conn_hist[j][k];
+		}
+		if (!n)
+			continue;
+		qsort(vals, n, sizeof(*vals), floatcmp);
+		sprintf(value, "n=%i p50=%.0f p90=%.0f p99=%.0f max=%.0f", n,
+				vals[(n-1)*50/100], vals[(n-1)*90/100],
+				vals[(n-1)*99/100], vals[n-1]);
+		publish_diag(valuetostr("connect/%s", (k < NCONNPHASES) ? connphases[k] : "total"), value);
+	}
+	publish_diag("connect/failed", valuetostr("%i", wif->nconn_failed));
+}
+
+static void conn_timeout(void *dat);
+
+/* finish the connection attempt, publish its timeline */
+static void conn_done(const char *result)
+{
+	char value[256];
+	int j, len, last;
+	double t0, now;
+	float *hist;
+
+	if (!wif->conn_active)
+		return;
+	wif->conn_active = 0;
+	libt_remove_timeout(conn_timeout, wif);
+
+	/* the attempt starts at the first phase seen */
+	for (j = 0; !wif->conn_t[j]; ++j);
+	t0 = wif->conn_t[j];
+	now = mono_now();
+	len = sprintf(value, "result=%s bssid=%s retries=%i total=%.0lf", result,
+			wif->conn_bssid[0] ? wif->conn_bssid : "-", wif->conn_retries,
+			(now - t0)*1e3);
+	for (; j < NCONNPHASES; ++j) {
+		if (wif->conn_t[j])
+			len += sprintf(value+len, " %s=%.0lf", connphases[j],
+					(wif->conn_t[j] - t0)*1e3);
+	}
+	publish_diag("connect", value);
+
+	if (strcmp(result, "connected")) {
+		++wif->nconn_failed;
+		publish_conn_stats();
+		return;
+	}
+	/* per phase, the time since the previous phase reached */
+	hist = wif->conn_hist[wif->conn_histpos];
+	for (j = 0, last = -1; j < NCONNPHASES; ++j) {
+		if (!wif->conn_t[j]) {
+			hist[j] = -1;
+			continue;
+		}
+		hist[j] = (last < 0) ? -1 : (wif->conn_t[j] - wif->conn_t[last])*1e3;
+		last = j;
+	}
+	hist[NCONNPHASES] = (now - t0)*1e3;
+	wif->conn_histpos = (wif->conn_histpos+1) % NCONNHIST;
+	if (wif->nconn_hist < NCONNHIST)
+		++wif->nconn_hist;
+	publish_conn_stats();
+}
+
+static void conn_timeout(void *dat)
+{
+	wif = dat;
+	conn_done("timeout");
+}
+
+/* a connection attempt reached phase */
+static void conn_phase(int phase)
+{
+	int j;
+
+	if (phase == CP_SELECT)
+		/* a new selection overrules the running attempt */
+		conn_done("aborted");
+	if (!wif->conn_active) {
+		if (phase >= CP_CONNECTED)
+			/* not an attempt we saw starting */
+			return;
+		memset(wif->conn_t, 0, sizeof(wif->conn_t));
+		wif->conn_bssid[0] = 0;
+		wif->conn_retries = 0;
+		wif->conn_active = 1;
+		libt_add_timeout(CONN_TIMEOUT, conn_timeout, wif);
+	} else if (phase == CP_STATUS && !wif->conn_t[CP_CONNECTED]) {
+		return;
+	} else if (wif->conn_t[phase]) {
+		/* wpa_supplicant retries, with the next BSS */
+		++wif->conn_retries;
+		for (j = phase+1; j < NCONNPHASES; ++j)
+			wif->conn_t[j] = 0;
+	}
+	wif->conn_t[phase] = mono_now();
+	if (phase == CP_STATUS)
+		conn_done("connected");
+}
+
+struct ssident {
+	char *ssid;
+	int refcnt;
+	int nextfree;
+	/* bss's that carry this ssid */
+	uint64_t *macs;
+	int nmacs, smacs;
+};
+
+
+static int ssidmatch(int idx, const void *key)
+{
+	return !strcmp(wif->ssids[idx].ssid, key);
+}
+
+static int find_ssid(const char *ssid)
+{
+	return hidx_find(&wif->ssididx, strhash(ssid), ssidmatch, ssid);
+}
+
+/* return ssid id, and take a reference */
+static int get_ssid(const char *ssid)
+{
+	struct ssident *se;
+	int id;
+
+	id = find_ssid(ssid);
+	if (id >= 0) {
+		++wif->ssids[id].refcnt;
+		return id;
+	}
+	if (wif->freessid >= 0) {
+		id = wif->freessid;
+		wif->freessid = wif->ssids[id].nextfree;
+	} else {
+		if (wif->nssids+1 > wif->sssids) {
+			wif->sssids += 16;
+			wif->ssids = realloc(wif->ssids, sizeof(*wif->ssids)*wif->sssids);
+			if (!wif->ssids)
+				mylog(LOG_ERR, "realloc %i ssids: %s", wif->sssids, ESTR(errno));
+		}
+		id = wif->nssids++;
+	}
+	se = wif->ssids+id;
+	memset(se, 0, sizeof(*se));
+	se->ssid = strdup(ssid);
+	se->refcnt = 1;
+	hidx_add(&wif->ssididx, strhash(ssid), id);
+	return id;
+}
+
+static void put_ssid(int id)
+{
+	struct ssident *se;
+
+	if (id < 0)
+		return;
+	se = wif->ssids+id;
+	if (--se->refcnt > 0)
+		return;
+	hidx_remove(&wif->ssididx, strhash(se->ssid), id);
+	myfree(se->ssid);
+	myfree(se->macs);
+	memset(se, 0, sizeof(*se));
+	se->nextfree = wif->freessid;
+	wif->freessid = id;
+}
+
+static void ssid_add_bss(int id, uint64_t mac)
+{
+	struct ssident *se = wif->ssids+id;
+
+	if (se->nmacs+1 > se->smacs) {
+		se->smacs += 4;
+		se->macs = realloc(se->macs, sizeof(*se->macs)*se->smacs);
+		if (!se->macs)
+			mylog(LOG_ERR, "realloc %i macs: %s", se->smacs, ESTR(errno));
+	}
+	se->macs[se->nmacs++] = mac;
+}
+
+static void ssid_remove_bss(int id, uint64_t mac)
+{
+	struct ssident *se = wif->ssids+id;
+	int j;
+
+	for (j = 0; j < se->nmacs; ++j) {
+		if (se->macs[j] == mac) {
+			se->macs[j] = se->macs[--se->nmacs];
+			break;
+		}
+	}
+}
+
 /* networks */
 struct network {
 	int id;
-	char *ssid;
+	char *ssid; /* from ssids[ssidid] */
+	int ssidid;
 	int netflags;
 #define NF_SEL	0x01
 #define NF_REMOVE	0x02 /* remove requested before ADD_NETWORK completed */
+#define NF_STALE	0x04 /* not (yet) seen in LIST_NETWORKS */
+#define NF_MODE	0x08 /* mode is known */
 	int flags;
 	/* use BF_ flags */
 	int mode; /* mode from config */
@@ -183,13 +936,6 @@ struct network {
 	int ncfgs, scfgs;
 };
 
-/* incrementing counter to distinguish the order of network creation */
-static int netcreateseq;
-
-static struct network *networks;
-static int nnetworks, snetworks;
-static int last_ap_id = -1;
-static int last_mesh_id = -1;
 
 static int networkcmp(const void *a, const void *b)
 {
@@ -206,16 +952,16 @@ static struct network *find_network_by_ssid(const char *ssid)
 
 	if (!ssid)
 		return NULL;
-	return bsearch(&needle, networks, nnetworks, sizeof(*networks), networkcmp);
+	return bsearch(&needle, wif->networks, wif->nnetworks, sizeof(*wif->networks), networkcmp);
 }
 
 static struct network *find_network_by_id(int idx)
 {
 	int j;
 
-	for (j = 0; j < nnetworks; ++j)
-		if (networks[j].id == idx)
-			return networks+j;
+	for (j = 0; j < wif->nnetworks; ++j)
+		if (wif->networks[j].id == idx)
+			return wif->networks+j;
 	return NULL;
 }
 
@@ -223,17 +969,18 @@ static struct network *add_network(int num, const char *ssid)
 {
 	struct network *net;
 
-	if (nnetworks+1 > snetworks) {
-		snetworks += 16;
-		networks = realloc(networks, sizeof(*networks)*snetworks);
-		if (!networks)
-			mylog(LOG_ERR, "realloc %i networks: %s", snetworks, ESTR(errno));
+	if (wif->nnetworks+1 > wif->snetworks) {
+		wif->snetworks += 16;
+		wif->networks = realloc(wif->networks, sizeof(*wif->networks)*wif->snetworks);
+		if (!wif->networks)
+			mylog(LOG_ERR, "realloc %i networks: %s", wif->snetworks, ESTR(errno));
 	}
-	net = &networks[nnetworks++];
+	net = &wif->networks[wif->nnetworks++];
 	memset(net, 0, sizeof(*net));
 
 	net->id = num;
-	net->ssid = strdup(ssid);
+	net->ssidid = get_ssid(ssid);
+	net->ssid = wif->ssids[net->ssidid].ssid;
 	return net;
 }
 
@@ -243,37 +990,41 @@ static void remove_network(struct network *net)
 	if (!net)
 		return;
 	/* handle memory */
-	myfree(net->ssid);
+	put_ssid(net->ssidid);
 	remove_network_configs(net);
 
 	/* remove element, keep sorted */
-	int idx = net - networks;
-	if (idx != nnetworks-1)
-		memmove(net, net+1, (nnetworks-1-idx)*sizeof(*networks));
-	--nnetworks;
+	int idx = net - wif->networks;
+	if (idx != wif->nnetworks-1)
+		memmove(net, net+1, (wif->nnetworks-1-idx)*sizeof(*wif->networks));
+	--wif->nnetworks;
 }
 
 static inline void sort_networks(void)
 {
-	qsort(networks, nnetworks, sizeof(*networks), networkcmp);
+	qsort(wif->networks, wif->nnetworks, sizeof(*wif->networks), networkcmp);
 }
 
 struct bss {
-	char bssid[20];
-	char *ssid;
+	uint64_t mac;
+	char bssid[18];
+	char *ssid; /* from ssids[ssidid] */
+	int ssidid;
 	int freq;
 	int level;
+	double levelt;
+	int heappos; /* position in bssshown or bsshidden */
 	int flags;
 		#define BF_WPA		0x01 /* 'w' */
 		#define BF_WEP		0x02 /* 'W' */
 		#define BF_EAP		0x04 /* 'e' */
 		#define BF_KNOWN	0x08 /* 'k' */
 		#define BF_DISABLED	0x10 /* 'd' */
+		#define BF_SHOWN	0x20 /* in bssshown, published */
 		#define BF_PRESENT	0x40 /* for re-adding */
 };
 
-static struct bss *bsss;
-static int nbsss, sbsss;
+/* bsss[] is unsorted, lookups go via the hash index on the binary MAC */
 
 static const char *bssflagsstr(const struct bss *bss)
 {
@@ -289,27 +1040,26 @@ static const char *bssflagsstr(const struct bss *bss)
 	return buf;
 }
 
-static int bssidcmp(const void *a, const void *b)
+static int bssmatch(int idx, const void *key)
 {
-	const struct bss *bssa = a, *bssb = b;
-
-	return strcmp(bssa->bssid, bssb->bssid);
+	return wif->bsss[idx].mac == *(const uint64_t *)key;
 }
 
-static struct bss *find_ap_by_bssid(const char *bssid)
+static struct bss *find_ap_by_mac(uint64_t mac)
 {
-	struct bss needle;
-
-	if (!bssid)
-		return NULL;
+	int idx;
 
-	strncpy(needle.bssid, bssid, sizeof(needle.bssid));
-	return bsearch(&needle, bsss, nbsss, sizeof(*bsss), bssidcmp);
+	idx = hidx_find(&wif->bssidx, u64hash(mac), bssmatch, &mac);
+	return (idx < 0) ? NULL : wif->bsss+idx;
 }
 
-static void sort_ap(void)
+static struct bss *find_ap_by_bssid(const char *bssid)
 {
-	qsort(bsss, nbsss, sizeof(*bsss), bssidcmp);
+	uint64_t mac;
+
+	if (strtomac(bssid, &mac) < 0)
+		return NULL;
+	return find_ap_by_mac(mac);
 }
 
 static void compute_network_flags(struct bss *bss, const struct network *net)
@@ -334,161 +1084,706 @@ static void compute_flags(struct bss *bss, const char *flags)
 		bss->flags |= BF_EAP;
 }
 
-static struct bss *add_ap(const char *bssid, int freq, int level, const char *ssid)
+/* bss ranking heaps, for -n & -L */
+static int bssheap_before(const struct bssheap *h, int a, int b)
 {
-	struct bss *bss;
+	int la = wif->bsss[h->idx[a]].level;
+	int lb = wif->bsss[h->idx[b]].level;
 
-	if (nbsss+1 > sbsss) {
-		sbsss += 16;
-		bsss = realloc(bsss, sizeof(*bsss)*sbsss);
-		if (!bsss)
-			mylog(LOG_ERR, "realloc %i bsss: %s", sbsss, ESTR(errno));
-	}
-	bss = &bsss[nbsss++];
-	memset(bss, 0, sizeof(*bss));
-	strncpy(bss->bssid, bssid, sizeof(bss->bssid));
-	bss->freq = freq;
-	bss->level = level;
-	if (ssid)
-		bss->ssid = strdup(ssid);
-	return bss;
+	return h->max ? la > lb : la < lb;
 }
 
-static void remove_ap(struct bss *bss)
+static void bssheap_set(struct bssheap *h, int pos, int idx)
 {
-	if (!bss)
-		return;
-	/* handle memory */
-	myfree(bss->ssid);
-
-	/* remove element, remain sorted */
-	int idx = bss - bsss;
-	if (idx != nbsss-1)
-		memcpy(bss, bss+1, (nbsss-1-idx)*sizeof(*bsss));
-	--nbsss;
+	h->idx[pos] = idx;
+	wif->bsss[idx].heappos = pos;
 }
 
-static void hide_ap_mqtt(const char *bssid)
+static void bssheap_swap(struct bssheap *h, int a, int b)
 {
-	publish_value("", topicfmt("net/%s/bss/%s/freq", iface, bssid));
-	publish_value("", topicfmt("net/%s/bss/%s/level", iface, bssid));
-	publish_value("", topicfmt("net/%s/bss/%s/flags", iface, bssid));
-	publish_value("", topicfmt("net/%s/bss/%s/ssid", iface, bssid));
+	int idx = h->idx[a];
+
+	bssheap_set(h, a, h->idx[b]);
+	bssheap_set(h, b, idx);
 }
 
-/* aggregated state */
-static const char *real_wifi_state;
-static const char *pub_wifi_state;
-static int selectedmode = -1; /* selected wpa_supplicant mode */
-static int is_mode_off(void)
+/* restore the heap order after the level at pos changed */
+static void bssheap_fix(struct bssheap *h, int pos)
 {
-	struct network *net;
-	int j;
-	int nnet = 0, ndis = 0;
+	int child;
 
-	/* find if all networks are disabled. Go off in that case */
-	for (net = networks, j = 0; j < nnetworks; ++net, ++j) {
-		if (selectedmode >= 0 && net->mode != selectedmode)
-			continue;
-		++nnet;
-		if (net->flags & BF_DISABLED)
-			++ndis;
+	for (; pos > 0 && bssheap_before(h, pos, (pos-1)/2); pos = (pos-1)/2)
+		bssheap_swap(h, pos, (pos-1)/2);
+	for (;; pos = child) {
+		child = pos*2+1;
+		if (child >= h->n)
+			break;
+		if (child+1 < h->n && bssheap_before(h, child+1, child))
+			++child;
+		if (!bssheap_before(h, child, pos))
+			break;
+		bssheap_swap(h, pos, child);
 	}
-	return nnet && ndis >= nnet;
 }
-static void set_wifi_state(const char *str)
+
+static void bssheap_add(struct bssheap *h, int idx)
 {
-	real_wifi_state = str;
-	if (!strcmp(str, "station")) {
-		if (saved_speed)
-			publish_value(NULL, topicfmt("net/%s/speed", iface));
-		saved_speed = 0;
-		if (saved_rssi)
-			publish_value(NULL, topicfmt("net/%s/rssi", iface));
-		saved_rssi = 0;
+	if (h->n+1 > h->s) {
+		h->s += 16;
+		h->idx = realloc(h->idx, sizeof(*h->idx)*h->s);
+		if (!h->idx)
+			mylog(LOG_ERR, "realloc %i bss heap: %s", h->s, ESTR(errno));
 	}
-	if (is_mode_off())
-		/* publish mode 'off' if all is disabled */
-		str = "off";
-
-	if (!strcmp(str, pub_wifi_state ?: ""))
-		return;
-	mylog(LOG_INFO, "state %s => %s", pub_wifi_state ?: "", str);
-	publish_value(str, topicfmt("net/%s/wifistate", iface));
-	pub_wifi_state = str;
+	bssheap_set(h, h->n++, idx);
+	bssheap_fix(h, h->n-1);
 }
-static inline void nets_enabled_changed(void)
+
+static void bssheap_remove(struct bssheap *h, int pos)
 {
-	/* repeat wifi state, maybe some networks were enabled/disabled */
-	set_wifi_state(real_wifi_state);
+	if (pos != --h->n) {
+		bssheap_set(h, pos, h->idx[h->n]);
+		bssheap_fix(h, pos);
+	}
 }
 
-
-static int nstations;
-static void set_wifi_stations(int n)
+static struct bss *bssheap_top(const struct bssheap *h)
 {
-	char buf[16];
-
-	nstations = n;
-	sprintf(buf, "%i", n);
-	if (n < 0)
-		strcpy(buf, "");
-	publish_value(buf, topicfmt("net/%s/stations", iface));
+	return h->n ? wif->bsss+h->idx[0] : NULL;
 }
 
-/* wpa functions */
-static inline int mystrncmp(const char *needle, const char *haystack)
+static struct bssheap *bss_heap(const struct bss *bss)
 {
-	return strncmp(needle, haystack, strlen(needle));
+	return (bss->flags & BF_SHOWN) ? &wif->bssshown : &wif->bsshidden;
 }
 
-static void wpa_cmd_timeout(void *);
-static void wpa_keepalive(void *);
-__attribute__((format(printf,1,2)))
-static int wpa_send(const char *fmt, ...)
+static void bss_rerank(void);
+
+static struct bss *add_ap(uint64_t mac, int freq, int level, const char *ssid)
 {
-	va_list va;
-	char *line;
-	int ret;
+	struct bss *bss;
 
-	va_start(va, fmt);
-	vasprintf(&line, fmt, va);
+	if (wif->nbsss+1 > wif->sbsss) {
+		wif->sbsss += 16;
+		wif->bsss = realloc(wif->bsss, sizeof(*wif->bsss)*wif->sbsss);
+		if (!wif->bsss)
+			mylog(LOG_ERR, "realloc %i bsss: %s", wif->sbsss, ESTR(errno));
+	}
+	bss = &wif->bsss[wif->nbsss++];
+	memset(bss, 0, sizeof(*bss));
+	bss->mac = mac;
+	mactostr(mac, bss->bssid);
+	bss->freq = freq;
+	bss->level = level;
+	bss->levelt = mono_now();
+	bss->ssidid = -1;
+	if (ssid) {
+		bss->ssidid = get_ssid(ssid);
+		bss->ssid = wif->ssids[bss->ssidid].ssid;
+		ssid_add_bss(bss->ssidid, mac);
+	}
+	hidx_add(&wif->bssidx, u64hash(mac), bss - wif->bsss);
+	return bss;
+}
+
+/* remove a BSS, rerank unless the caller reranks once for many */
+static void remove_ap(struct bss *bss, int rerank)
+{
+	if (!bss)
+		return;
+	/* handle memory */
+	if (bss->ssidid >= 0) {
+		ssid_remove_bss(bss->ssidid, bss->mac);
+		put_ssid(bss->ssidid);
+	}
+
+	/* remove element, fill the hole with the last one */
+	int idx = bss - wif->bsss;
+	hidx_remove(&wif->bssidx, u64hash(bss->mac), idx);
+	if (bssranked)
+		bssheap_remove(bss_heap(bss), bss->heappos);
+	if (idx != wif->nbsss-1) {
+		*bss = wif->bsss[wif->nbsss-1];
+		hidx_renumber(&wif->bssidx, u64hash(bss->mac), wif->nbsss-1, idx);
+		if (bssranked)
+			bss_heap(bss)->idx[bss->heappos] = idx;
+	}
+	--wif->nbsss;
+	if (bssranked && rerank)
+		/* a hidden BSS may take its place */
+		bss_rerank();
+}
+
+static void publish_bsstable(void *dat)
+{
+	static char *buf;
+	static int sbuf;
+	int j, len, fill = 0;
+	const struct bss *bss;
+
+	wif = dat;
+	wif->bsstable_dirty = 0;
+	for (j = 0, bss = wif->bsss; j < wif->nbsss; ++j, ++bss) {
+		if (bssranked && !(bss->flags & BF_SHOWN))
+			continue;
+		len = strlen(bss->ssid ?: "") + 64;
+		if (fill + len > sbuf) {
+			sbuf = (fill + len + 1023) & ~1023;
+			buf = realloc(buf, sbuf);
+			if (!buf)
+				mylog(LOG_ERR, "realloc %i: %s", sbuf, ESTR(errno));
+		}
+		fill += sprintf(buf+fill, "%s%s %.3lfG %i %s %s", fill ? "\n" : "",
+				bss->bssid, bss->freq*1e-3, bss->level,
+				bssflagsstr(bss), bss->ssid ?: "");
+	}
+	publish_value(fill ? buf : "", topicfmt("net/%s/bsstable", wif->iface));
+}
+
+static void bsstable_changed(void)
+{
+	if (!bsstable || wif->bsstable_dirty)
+		return;
+	/* republish at most once per second */
+	wif->bsstable_dirty = 1;
+	libt_add_timeout(1, publish_bsstable, wif);
+}
+
+/* publish (changed) BSS properties */
+#define BP_SSID		0x01
+#define BP_FREQ		0x02
+#define BP_LEVEL	0x04
+#define BP_FLAGS	0x08
+#define BP_ALL		0x0f
+static void publish_bss(const struct bss *bss, int what)
+{
+	if (!what || (bssranked && !(bss->flags & BF_SHOWN)))
+		return;
+	if (compactbss) {
+		publish_value(valuetostr("%.3lfG %i %s %s", bss->freq*1e-3, bss->level,
+					bssflagsstr(bss), bss->ssid ?: ""),
+				topicfmt("net/%s/bss/%s", wif->iface, bss->bssid));
+	} else {
+		if (what & BP_SSID)
+			publish_value(bss->ssid, topicfmt("net/%s/bss/%s/ssid", wif->iface, bss->bssid));
+		if (what & BP_FREQ)
+			publish_value(valuetostr("%.3lfG", bss->freq*1e-3),
+					topicfmt("net/%s/bss/%s/freq", wif->iface, bss->bssid));
+		if (what & BP_LEVEL)
+			publish_value(valuetostr("%i", bss->level),
+					topicfmt("net/%s/bss/%s/level", wif->iface, bss->bssid));
+		/* publish flags as last */
+		if (what & BP_FLAGS)
+			publish_value(bssflagsstr(bss),
+					topicfmt("net/%s/bss/%s/flags", wif->iface, bss->bssid));
+	}
+	bsstable_changed();
+}
+
+static void hide_ap_mqtt(const char *bssid)
+{
+	if (compactbss) {
+		publish_value("", topicfmt("net/%s/bss/%s", wif->iface, bssid));
+	} else {
+		publish_value("", topicfmt("net/%s/bss/%s/freq", wif->iface, bssid));
+		publish_value("", topicfmt("net/%s/bss/%s/level", wif->iface, bssid));
+		publish_value("", topicfmt("net/%s/bss/%s/flags", wif->iface, bssid));
+		publish_value("", topicfmt("net/%s/bss/%s/ssid", wif->iface, bssid));
+	}
+	bsstable_changed();
+}
+
+/* BSS ranking: with -n or -L, only the BSSs that cross the cutoff
+ * are published or hidden when a level changes
+ */
+static void show_bss(struct bss *bss)
+{
+	bssheap_remove(&wif->bsshidden, bss->heappos);
+	bss->flags |= BF_SHOWN;
+	bssheap_add(&wif->bssshown, bss - wif->bsss);
+	publish_bss(bss, BP_ALL);
+}
+
+static void unshow_bss(struct bss *bss)
+{
+	bssheap_remove(&wif->bssshown, bss->heappos);
+	bss->flags &= ~BF_SHOWN;
+	bssheap_add(&wif->bsshidden, bss - wif->bsss);
+	hide_ap_mqtt(bss->bssid);
+}
+
+static void bss_rerank(void)
+{
+	struct bss *shown, *hidden;
+
+	/* drop the weakest published BSSs beyond the limits */
+	while ((shown = bssheap_top(&wif->bssshown)) != NULL &&
+			((bsstop && wif->bssshown.n > bsstop) ||
+			 shown->level < bssminlevel))
+		unshow_bss(shown);
+	/* publish the strongest hidden BSSs while they fit */
+	while ((hidden = bssheap_top(&wif->bsshidden)) != NULL &&
+			hidden->level >= bssminlevel) {
+		if (!bsstop || wif->bssshown.n < bsstop) {
+			show_bss(hidden);
+			continue;
+		}
+		shown = bssheap_top(&wif->bssshown);
+		if (hidden->level <= shown->level)
+			break;
+		unshow_bss(shown);
+		show_bss(hidden);
+	}
+}
+
+/* rank a new BSS, or a BSS whose level changed */
+static void rank_bss(struct bss *bss, int isnew)
+{
+	if (isnew)
+		bssheap_add(&wif->bsshidden, bss - wif->bsss);
+	else
+		bssheap_fix(bss_heap(bss), bss->heappos);
+	bss_rerank();
+}
+
+/* hide a BSS in MQTT before removing it */
+static void unpublish_bss(const struct bss *bss)
+{
+	if (!bssranked || (bss->flags & BF_SHOWN))
+		hide_ap_mqtt(bss->bssid);
+}
+
+/* aggregated state */
+static int is_mode_off(void)
+{
+	struct network *net;
+	int j;
+	int nnet = 0, ndis = 0;
+
+	/* find if all networks are disabled. Go off in that case */
+	for (net = wif->networks, j = 0; j < wif->nnetworks; ++net, ++j) {
+		if (wif->selectedmode >= 0 && net->mode != wif->selectedmode)
+			continue;
+		++nnet;
+		if (net->flags & BF_DISABLED)
+			++ndis;
+	}
+	return nnet && ndis >= nnet;
+}
+static void set_wifi_state(const char *str)
+{
+	wif->real_wifi_state = str;
+	if (!strcmp(str, "station")) {
+		clear_hyst(HY_SPEED);
+		clear_hyst(HY_RSSI);
+	}
+	if (is_mode_off())
+		/* publish mode 'off' if all is disabled */
+		str = "off";
+
+	if (!strcmp(str, wif->pub_wifi_state ?: ""))
+		return;
+	mylog(LOG_INFO, "state %s => %s", wif->pub_wifi_state ?: "", str);
+	publish_value(str, topicfmt("net/%s/wifistate", wif->iface));
+	wif->pub_wifi_state = str;
+}
+static inline void nets_enabled_changed(void)
+{
+	/* repeat wifi state, maybe some networks were enabled/disabled */
+	if (wif->real_wifi_state)
+		set_wifi_state(wif->real_wifi_state);
+}
+
+
+static void set_wifi_stations(int n)
+{
+	char buf[16];
+
+	sprintf(buf, "%i", n);
+	if (n < 0)
+		strcpy(buf, "");
+	publish_value(buf, topicfmt("net/%s/stations", wif->iface));
+}
+
+/* wpa functions */
+static inline int mystrncmp(const char *needle, const char *haystack)
+{
+	return strncmp(needle, haystack, strlen(needle));
+}
+
+static void wpa_cmd_timeout(void *);
+static void wpa_keepalive(void *);
+static int wpa_connect(int fatal);
+
+/* the oldest command in flight sets the deadline for its reply */
+static void wpa_arm_cmd_timeout(void)
+{
+	double left;
+
+	if (!wif->strq) {
+		libt_remove_timeout(wpa_cmd_timeout, wif);
+		return;
+	}
+	left = wif->strq->tsent + 3 - mono_now();
+	libt_add_timeout((left > 0) ? left : 0, wpa_cmd_timeout, wif);
+}
+
+/* send queued commands while the window allows */
+static void wpa_send_queued(void)
+{
+	struct str *str;
+	int j, ret;
+
+	for (j = 0; j < NLANES && wif->wpasock >= 0; ++j) {
+		while (wif->ninflight < WPA_WINDOW && wif->lanes[j].head) {
+			str = pop_str(&wif->lanes[j].head, &wif->lanes[j].last);
+			unhash_cmd(str);
+			ret = send(wif->wpasock, str->a, strlen(str->a), 0);
+			if (ret < 0) {
+				mylog(LOG_WARNING, "send wpa: %s", ESTR(errno));
+				drop_cmd(str);
+				/* reconnect, outside of the current call chain */
+				libt_add_timeout(0, wpa_cmd_timeout, wif);
+				return;
+			}
+			mylog(LOG_DEBUG, "> %s", str->a);
+			str->tsent = mono_now();
+			append_str(&wif->strq, &wif->strqlast, str);
+			++wif->ninflight;
+			wpa_arm_cmd_timeout();
+			libt_add_timeout(keepalive_delay, wpa_keepalive, wif);
+		}
+	}
+}
+
+/* the command that carries out the last wpa_send,
+ * the queued one it merged into, or NULL when dropped
+ */
+static struct str *last_queued;
+
+static int wpa_vsend(int lane, const char *fmt, va_list va)
+{
+	struct str *str, *queued;
+	unsigned int hash = 0;
+	int verb, len;
+	va_list va2;
+
+	last_queued = NULL;
+	/* format in place */
+	str = get_str();
+	va_copy(va2, va);
+	len = vsnprintf(str->buf, sizeof(str->buf), fmt, va);
+	if (len >= sizeof(str->buf)) {
+		str->a = malloc(len+1);
+		if (!str->a)
+			mylog(LOG_ERR, "malloc %i: %s", len+1, ESTR(errno));
+		++nstr_allocs;
+		vsnprintf(str->a, len+1, fmt, va2);
+	}
+	va_end(va2);
+	verb = cmdverb(str->a);
+
+	if (wif->wpasock < 0) {
+		/* reconnecting, drop. The resync only restores what
+		 * wpa_supplicant has, so report lost changes & scans.
+		 * ADD_NETWORK is not lost: its network keeps id -1 and
+		 * holds its config, and wpa_recvd_attach adds it again.
+		 */
+		if (((cmdverbs[verb].flags & CMD_MUTATION) && verb != cmdverb("ADD_NETWORK"))
+				|| verb == cmdverb("SCAN")) {
+			mylog(LOG_WARNING, "'%s': wpa_supplicant not connected", str->a);
+			publish_failure("'%s': not connected", cmdverbs[verb].name);
+		}
+		put_str(str);
+		return -1;
+	}
+
+	if (cmdverbs[verb].flags & CMD_IDEMPOTENT) {
+		hash = strhash(str->a);
+		queued = find_queued_cmd(str->a, hash);
+		if (queued && queued->lane <= lane) {
+			/* the queued one will do */
+			++wif->ncmds_merged;
+			put_str(str);
+			last_queued = queued;
+			return 0;
+		}
+	}
+	str->verb = verb;
+	str->lane = lane;
+	str->flags = 0;
+	str->hash = hash;
+	str->tqueued = mono_now();
+	if (cmdverbs[verb].flags & CMD_IDEMPOTENT) {
+		/* newest first, it has the highest priority */
+		str->hnext = wif->cmdhash[hash % NCMDHASH];
+		wif->cmdhash[hash % NCMDHASH] = str;
+	}
+	if (cmdverbs[verb].flags & CMD_MUTATION)
+		++wif->npending_mutations;
+	append_str(&wif->lanes[lane].head, &wif->lanes[lane].last, str);
+	last_queued = str;
+
+	wpa_send_queued();
+	return 0;
+}
+
+__attribute__((format(printf,1,2)))
+static int wpa_send(const char *fmt, ...)
+{
+	va_list va;
+	int ret;
+
+	va_start(va, fmt);
+	ret = wpa_vsend(LANE_INTERACTIVE, fmt, va);
 	va_end(va);
+	return ret;
+}
 
-	ret = send(wpasock, line, strlen(line), 0);
-	if (ret < 0)
-		mylog(LOG_ERR, "send wpa: %s", ESTR(errno));
-	add_strq(line);
-	mylog(LOG_DEBUG, "> %s", line);
-	free(line);
-	libt_add_timeout(3, wpa_cmd_timeout, NULL);
-	libt_add_timeout(5, wpa_keepalive, NULL);
+/* background refreshes */
+__attribute__((format(printf,1,2)))
+static int wpa_send_bulk(const char *fmt, ...)
+{
+	va_list va;
+	int ret;
+
+	va_start(va, fmt);
+	ret = wpa_vsend(LANE_BULK, fmt, va);
+	va_end(va);
 	return ret;
 }
 
+static void wpa_reconnect(void *dat)
+{
+	wif = dat;
+	wif->wpasock = wpa_connect(0);
+	if (wif->wpasock < 0) {
+		libt_add_timeout(1, wpa_reconnect, dat);
+		return;
+	}
+	/* the ATTACH reply reconciles our tables */
+	wpa_send("ATTACH");
+}
+
 static void wpa_cmd_timeout(void *dat)
 {
-	/* no pong recvd, reattach? */
+	struct str *head;
+
+	wif = dat;
+	/* no pong recvd, reconnect */
 	mylog(LOG_WARNING, "wpa lost");
-	wpa_lost = 1;
+	close(wif->wpasock);
+	wif->wpasock = -1;
+	/* replies for pending commands will never arrive */
+	for (head = pop_strq(); head; head = pop_strq())
+		put_str(head);
+	flush_lanes();
+	libt_remove_timeout(wpa_cmd_timeout, wif);
+	libt_remove_timeout(wpa_keepalive, wif);
+	wif->bss_bulk_busy = 0;
+	wif->wpa_synced = 0;
+	/* a requested scan is lost with the connection */
+	wif->scan_accepted = 0;
+	libt_add_timeout(1, wpa_reconnect, wif);
 }
 
 static void wpa_keepalive(void *dat)
 {
-	if (!curr_mode && curr_bssid[0])
+	wif = dat;
+	if (!wif->curr_mode && wif->curr_bssid[0] && !sigmon)
 	{
-		wpa_send("BSS %s", curr_bssid);
+		wpa_send("BSS %s", wif->curr_bssid);
 		wpa_send("SIGNAL_POLL");
 	}
 	else
 		wpa_send("PING");
 }
 
+/* AP stations & mesh peers */
+struct sta {
+	uint64_t mac;
+	char addr[18];
+	int staflags;
+#define SF_STALE	0x01 /* not (yet) seen in STA-FIRST/STA-NEXT */
+#define SF_PUBLISHED	0x02 /* per-station topics exist */
+	int signal;
+	time_t since;
+	unsigned long long rxbytes, txbytes;
+};
+
+
+static int stamatch(int idx, const void *key)
+{
+	return wif->stas[idx].mac == *(const uint64_t *)key;
+}
+
+static struct sta *find_sta(const char *addr)
+{
+	uint64_t mac;
+	int idx;
+
+	if (strtomac(addr, &mac) < 0)
+		return NULL;
+	idx = hidx_find(&wif->staidx, u64hash(mac), stamatch, &mac);
+	return (idx < 0) ? NULL : wif->stas+idx;
+}
+
+static struct sta *add_sta(const char *addr)
+{
+	struct sta *sta;
+	uint64_t mac;
+
+	sta = find_sta(addr);
+	if (sta)
+		return sta;
+	if (strtomac(addr, &mac) < 0) {
+		mylog(LOG_WARNING, "invalid station '%s'", addr ?: "");
+		return NULL;
+	}
+	if (wif->nstas+1 > wif->sstas) {
+		wif->sstas += 16;
+		wif->stas = realloc(wif->stas, sizeof(*wif->stas)*wif->sstas);
+		if (!wif->stas)
+			mylog(LOG_ERR, "realloc %i stas: %s", wif->sstas, ESTR(errno));
+	}
+	sta = &wif->stas[wif->nstas++];
+	memset(sta, 0, sizeof(*sta));
+	sta->mac = mac;
+	mactostr(mac, sta->addr);
+	sta->since = time(NULL);
+	hidx_add(&wif->staidx, u64hash(mac), sta - wif->stas);
+	return sta;
+}
+
+static void remove_sta(struct sta *sta)
+{
+	if (!sta)
+		return;
+	if (sta->staflags & SF_PUBLISHED) {
+		publish_value("", topicfmt("net/%s/sta/%s/signal", wif->iface, sta->addr));
+		publish_value("", topicfmt("net/%s/sta/%s/connected", wif->iface, sta->addr));
+		publish_value("", topicfmt("net/%s/sta/%s/rxbytes", wif->iface, sta->addr));
+		publish_value("", topicfmt("net/%s/sta/%s/txbytes", wif->iface, sta->addr));
+	}
+
+	/* remove element, fill the hole with the last one */
+	int idx = sta - wif->stas;
+	hidx_remove(&wif->staidx, u64hash(sta->mac), idx);
+	if (idx != wif->nstas-1) {
+		*sta = wif->stas[wif->nstas-1];
+		hidx_renumber(&wif->staidx, u64hash(sta->mac), wif->nstas-1, idx);
+	}
+	--wif->nstas;
+}
+
+static void flush_stas(void)
+{
+	while (wif->nstas)
+		remove_sta(wif->stas+wif->nstas-1);
+}
+
+/* parse a STA, STA-FIRST or STA-NEXT reply */
+static struct sta *wpa_sta_info(char *line, char *end)
+{
+	struct kv kv;
+	struct sta *sta;
+	int signal;
+	time_t since;
+	unsigned long long rxbytes, txbytes;
+
+	sta = add_sta(next_line(&line, end));
+	if (!sta)
+		return NULL;
+	sta->staflags &= ~SF_STALE;
+	signal = sta->signal;
+	since = sta->since;
+	rxbytes = sta->rxbytes;
+	txbytes = sta->txbytes;
+	while (next_kv(&line, end, &kv))
+	switch (kv.hash) {
+	case KVHASH(6, 's', 'l'):
+		if (KVIS(&kv, "signal"))
+			signal = strtol(kv.val, NULL, 0);
+		break;
+	case KVHASH(14, 'c', 'e'):
+		if (KVIS(&kv, "connected_time")) {
+			since = time(NULL) - strtoul(kv.val, NULL, 0);
+			/* ignore rounding jitter */
+			if (labs(since - sta->since) <= 2)
+				since = sta->since;
+		}
+		break;
+	case KVHASH(8, 'r', 's'):
+		if (KVIS(&kv, "rx_bytes"))
+			rxbytes = strtoull(kv.val, NULL, 0);
+		break;
+	case KVHASH(8, 't', 's'):
+		if (KVIS(&kv, "tx_bytes"))
+			txbytes = strtoull(kv.val, NULL, 0);
+		break;
+	}
+	if (!sta_poll_delay)
+		return sta;
+
+	int all = !(sta->staflags & SF_PUBLISHED);
+
+	sta->staflags |= SF_PUBLISHED;
+	if (all || signal != sta->signal)
+		publish_value(valuetostr("%i", signal),
+				topicfmt("net/%s/sta/%s/signal", wif->iface, sta->addr));
+	if (all || since != sta->since)
+		publish_value(valuetostr("%lli", (long long)since),
+				topicfmt("net/%s/sta/%s/connected", wif->iface, sta->addr));
+	if (all || rxbytes != sta->rxbytes)
+		publish_value(valuetostr("%llu", rxbytes),
+				topicfmt("net/%s/sta/%s/rxbytes", wif->iface, sta->addr));
+	if (all || txbytes != sta->txbytes)
+		publish_value(valuetostr("%llu", txbytes),
+				topicfmt("net/%s/sta/%s/txbytes", wif->iface, sta->addr));
+	sta->signal = signal;
+	sta->since = since;
+	sta->rxbytes = rxbytes;
+	sta->txbytes = txbytes;
+	return sta;
+}
+
+/* full enumeration, after (re)attach */
+static void wpa_sta_enumerate(void)
+{
+	int j;
+
+	for (j = 0; j < wif->nstas; ++j)
+		wif->stas[j].staflags |= SF_STALE;
+	wpa_send_bulk("STA-FIRST");
+}
+
+static void wpa_sta_enumerated(void)
+{
+	int j;
+
+	/* drop stations that left while we were away */
+	for (j = wif->nstas-1; j >= 0; --j) {
+		if (wif->stas[j].staflags & SF_STALE)
+			remove_sta(wif->stas+j);
+	}
+	set_wifi_stations(wif->nstas);
+}
+
+static void sta_poll(void *dat)
+{
+	int j;
+
+	wif = dat;
+	/* all stations in 1 go */
+	for (j = 0; j < wif->nstas; ++j)
+		wpa_send_bulk("STA %s", wif->stas[j].addr);
+	libt_add_timeout(sta_poll_delay, sta_poll, dat);
+}
+
 static struct network *find_last_network_mode(const struct network *exclude, int mode)
 {
 	struct network *net, *ap = NULL;
 
-	for (net = networks; net < networks+nnetworks; ++net) {
+	for (net = wif->networks; net < wif->networks+wif->nnetworks; ++net) {
 		if (net == exclude)
 			continue;
 		if (net->mode == mode) {
@@ -499,56 +1794,113 @@ static struct network *find_last_network_mode(const struct network *exclude, int
 	return ap;
 }
 
-static void network_changed(const struct network *net, int removing)
+/* update the flags of the bss's of this network */
+static void network_bss_changed(const struct network *net, int removing)
 {
 	int j, flags;
 	struct bss *bss;
+	const struct ssident *se = wif->ssids+net->ssidid;
 
-	for (j = 0, bss = bsss; j < nbsss; ++j, ++bss) {
-		if (!bss->ssid)
-			continue;
-		if (strcmp(bss->ssid, net->ssid))
+	for (j = 0; j < se->nmacs; ++j) {
+		bss = find_ap_by_mac(se->macs[j]);
+		if (!bss)
 			continue;
 		flags = bss->flags;
 		compute_network_flags(bss, removing ? NULL : net);
 		if (flags != bss->flags)
-			publish_value(bssflagsstr(bss), topicfmt("net/%s/bss/%s/flags", iface, bss->bssid));
+			publish_bss(bss, BP_FLAGS);
 	}
+}
 
+static void update_last_ap(const struct network *exclude)
+{
 	/* keep track of 'lastAP' */
-	struct network *lastap = find_last_network_mode(removing ? net : NULL, 2);
+	struct network *lastap = find_last_network_mode(exclude, 2);
 	int new_last_ap_id = lastap ? lastap->id : -1;
 
-	if (new_last_ap_id != last_ap_id) {
-		last_ap_id = new_last_ap_id;
-		publish_value(lastap ? lastap->ssid : "", topicfmt("net/%s/lastAP", iface));
+	if (new_last_ap_id != wif->last_ap_id) {
+		wif->last_ap_id = new_last_ap_id;
+		publish_value(lastap ? lastap->ssid : "", topicfmt("net/%s/lastAP", wif->iface));
 	}
 
 	/* same for lastmesh */
-	struct network *lastmesh = find_last_network_mode(removing ? net : NULL, 5);
+	struct network *lastmesh = find_last_network_mode(exclude, 5);
 	int new_last_mesh_id = lastmesh ? lastmesh->id : -1;
 
-	if (new_last_mesh_id != last_mesh_id) {
-		last_mesh_id = new_last_mesh_id;
-		publish_value(lastmesh ? lastmesh->ssid : "", topicfmt("net/%s/lastmesh", iface));
+	if (new_last_mesh_id != wif->last_mesh_id) {
+		wif->last_mesh_id = new_last_mesh_id;
+		publish_value(lastmesh ? lastmesh->ssid : "", topicfmt("net/%s/lastmesh", wif->iface));
 	}
 }
 
-static void wpa_save_config(void)
+static void network_changed(const struct network *net, int removing)
 {
-	struct str *str;
+	network_bss_changed(net, removing);
+	update_last_ap(removing ? net : NULL);
+}
 
-	for (str = strq; str; str = str->next) {
-		if (!mystrncmp("SET_NETWORK", str->a) ||
-				!mystrncmp("ENABLE_NETWORK", str->a) ||
-				!mystrncmp("DISABLE_NETWORK", str->a) ||
-				!mystrncmp("SELECT_NETWORK", str->a) ||
-				!mystrncmp("REMOVE_NETWORK", str->a) ||
-				!mystrncmp("ADD_NETWORK", str->a))
-			break;
+static void select_network(const struct network *net)
+{
+	wpa_send("SELECT_NETWORK %i", net->id);
+	if (!net->mode)
+		/* time the station connection */
+		conn_phase(CP_SELECT);
+}
+
+/* net just received its id, flush what was held for it */
+static void network_created(struct network *net)
+{
+	int j;
+
+	if (net->netflags & NF_REMOVE) {
+		wpa_send("REMOVE_NETWORK %i", net->id);
+		network_changed(net, 1);
+		remove_network(net);
+		nets_enabled_changed();
+		return;
 	}
-	if (!str)
-		wpa_send("SAVE_CONFIG");
+
+	wpa_send("SET_NETWORK %i ssid \"%s\"", net->id, net->ssid);
+	for (j = 0; j < net->ncfgs; j += 2)
+		wpa_send("SET_NETWORK %i %s %s", net->id, net->cfgs[j], net->cfgs[j+1]);
+	remove_network_configs(net);
+
+	if (net->netflags & NF_SEL)
+		select_network(net);
+	else if (!(net->flags & BF_DISABLED))
+		/* enable station-mode networks automatically */
+		wpa_send("ENABLE_NETWORK %i", net->id);
+	nets_enabled_changed();
+}
+
+/* SAVE_CONFIG write-back */
+
+static int wpa_config_changes_pending(void)
+{
+	return wif->npending_mutations > 0;
+}
+
+static void wpa_save_config_timeout(void *dat)
+{
+	wif = dat;
+	wif->save_pending = 0;
+	if (wpa_config_changes_pending())
+		/* the last pending change will request a save again */
+		return;
+	++wif->nsaves;
+	wpa_send("SAVE_CONFIG");
+	publish_diag("saveconfig", valuetostr("issued=%i avoided=%i",
+				wif->nsaves, wif->nsave_requests - wif->nsaves));
+}
+
+static void wpa_save_config(void)
+{
+	++wif->nsave_requests;
+	if (wif->save_pending)
+		return;
+	/* merge all changes within save_delay into 1 SAVE_CONFIG */
+	wif->save_pending = 1;
+	libt_add_timeout(save_delay, wpa_save_config_timeout, wif);
 }
 
 static void add_network_config(struct network *net, const char *key, const char *value)
@@ -581,530 +1933,1355 @@ static void remove_network_configs(struct network *net)
 	net->cfgs = NULL;
 }
 
-static void wpa_recvd_pkt(char *line)
+/* BSS field mask for bulk requests:
+ * id, bssid, freq, level, flags, ssid, and a '====' delimiter per record
+ */
+#define BSS_BULK_MASK	0x21887
+
+static void wpa_scan_results(void)
 {
-	int ret, j;
-	char *tok, *saveptr, *nl;
-	struct str *head;
+	int j;
 
-	ret = strlen(line);
-	if (ret && line[ret-1] == '\n')
-		line[ret-1] = 0;
-	/* prepare log */
-	nl = strchr(line, '\n');
-	mylog(LOG_DEBUG, "< %.*s%s", (int)(nl ? nl - line : strlen(line)), line, nl ? " ..." : "");
+	if (!bulkbss) {
+		wpa_send_bulk("SCAN_RESULTS");
+		return;
+	}
+	if (wif->bss_bulk_busy)
+		/* the running series will pick up the new entries */
+		return;
+	/* clear BF_PRESENT flag in bss list */
+	for (j = 0; j < wif->nbsss; ++j)
+		wif->bsss[j].flags &= ~BF_PRESENT;
+	wif->bss_bulk_busy = 1;
+	wpa_send_bulk("BSS RANGE=ALL MASK=0x%x", BSS_BULK_MASK);
+}
 
-	if (!mystrncmp("<2>", line) || !mystrncmp("<3>", line) || !mystrncmp("<4>", line)) {
-		/* publish line+3 to mqtt log */
-		char topic[128];
+/* remove all bss's that were not marked present */
+static void wpa_sweep_bss(void)
+{
+	int j;
 
-		/* don't use publish_value, it has hardcoded retain=1 */
-		sprintf(topic, "tmp/%s/wpa", iface);
-		ret = mosquitto_publish(mosq, NULL, topic, strlen(line+3), line+3, mqtt_qos, 0);
-		if (ret)
-			mylog(LOG_ERR, "mosquitto_publish %s: %s", topic, mosquitto_strerror(ret));
-		/* process value */
-		tok = strtok(line+3, " \t");
-		if (!strcmp(tok, "CTRL-EVENT-CONNECTED")) {
-			if (!curr_mode) {
-				/* only set station when not connected as AP */
-				set_wifi_state("station");
-				wpa_send("SIGNAL_POLL");
-			}
-			wpa_send("STATUS");
-		} else if (!strcmp(tok, "CTRL-EVENT-DISCONNECTED")) {
-			wpa_send("STATUS");
-			set_wifi_state("none");
-		} else if (!strcmp(tok, "AP-ENABLED")) {
-			curr_mode = 2;
-			set_wifi_state("AP");
-			set_wifi_stations(0);
-		} else if (!strcmp(tok, "AP-DISABLED")) {
-			curr_mode = 0;
-			/* issue scan request immediately */
-			wpa_send("SCAN");
-			set_wifi_stations(-1);
-		} else if (!strcmp(tok, "AP-STA-CONNECTED")) {
-			set_wifi_stations(nstations+1);
-		} else if (!strcmp(tok, "AP-STA-DISCONNECTED")) {
-			set_wifi_stations(nstations-1);
+	for (j = 0; j < wif->nbsss; ) {
+		if (wif->bsss[j].flags & BF_PRESENT) {
+			++j;
+			continue;
+		}
+		/* remove this bss */
+		unpublish_bss(wif->bsss+j);
+		remove_ap(wif->bsss+j, 0);
+	}
+	if (bssranked)
+		/* hidden BSSs may take the freed places */
+		bss_rerank();
+}
 
-		} else if (!strcmp(tok, "MESH-GROUP-STARTED")) {
-			curr_mode = 5;
-			set_wifi_state("mesh");
-			set_wifi_stations(0);
+/* process 1 BSS record, return its wpa_supplicant id, if present */
+static int wpa_bss_info(char *line, char *end)
+{
+	struct kv kv;
+	char *bssid = NULL;
+	char *ssid = NULL;
+	char *flags = NULL;
+	int freq = 0, level = 0, id = -1;
+
+	while (next_kv(&line, end, &kv))
+	switch (kv.hash) {
+	case KVHASH(5, 'b', 'd'):
+		if (KVIS(&kv, "bssid"))
+			bssid = kv.val;
+		break;
+	case KVHASH(2, 'i', 'd'):
+		if (KVIS(&kv, "id"))
+			id = strtoul(kv.val, NULL, 0);
+		break;
+	case KVHASH(4, 'f', 'q'):
+		if (KVIS(&kv, "freq"))
+			freq = strtoul(kv.val, NULL, 0);
+		break;
+	case KVHASH(5, 'l', 'l'):
+		if (KVIS(&kv, "level"))
+			level = strtol(kv.val, NULL, 0);
+		break;
+	case KVHASH(5, 'f', 's'):
+		if (KVIS(&kv, "flags"))
+			flags = kv.val;
+		break;
+	case KVHASH(4, 's', 'd'):
+		if (KVIS(&kv, "ssid"))
+			ssid = kv.val;
+		break;
+	}
+	struct bss *bss;
+	uint64_t mac;
 
-		} else if (!strcmp(tok, "MESH-GROUP-REMOVED")) {
-			curr_mode = 0;
-			set_wifi_stations(-1);
+	if (ssid && !strncmp(ssid, "\\x00", 4))
+		/* ignore ssid's that start with \x00
+		 * it's most probably a hidden ssid */
+		return id;
 
-		} else if (!strcmp(tok, "MESH-PEER-CONNECTED")) {
-			set_wifi_stations(nstations+1);
-		} else if (!strcmp(tok, "MESH-PEER-DISCONNECTED")) {
-			set_wifi_stations(nstations-1);
-
-
-		} else if (!strcmp(tok, "CTRL-EVENT-BSS-ADDED")) {
-			strtok(NULL, " \t");
-			tok = strtok(NULL, " \t");
-			wpa_send("BSS %s", tok);
-			have_bss_events = 1;
-		} else if (!strcmp(tok, "CTRL-EVENT-BSS-REMOVED")) {
-			strtok(NULL, " \t");
-			tok = strtok(NULL, " \t");
-			remove_ap(find_ap_by_bssid(tok));
-			sort_ap();
-			hide_ap_mqtt(tok);
-			have_bss_events = 1;
-		} else if (!strcmp(tok, "CTRL-EVENT-SCAN-RESULTS")) {
-			if (!have_bss_events)
-				wpa_send("SCAN_RESULTS");
-		}
-		return;
+	/* parse once, for the lookup and for a new BSS */
+	if (strtomac(bssid, &mac) < 0) {
+		mylog(LOG_WARNING, "invalid bssid '%s'", bssid ?: "");
+		return id;
 	}
-	head = pop_strq();
-	if (!head) {
-		mylog(LOG_WARNING, "unsolicited response '%s'", line);
-		return;
+	bss = find_ap_by_mac(mac);
+	if (bss) {
+		int what = 0;
+
+		if (bss->freq != freq)
+			what |= BP_FREQ;
+		if (hyst_changed(HY_BSSLEVEL, &bss->level, &bss->levelt, level))
+			what |= BP_LEVEL;
+		bss->freq = freq;
+		int savedflags = bss->flags;
+		compute_flags(bss, flags);
+		if (savedflags != bss->flags)
+			what |= BP_FLAGS;
+		int shown = bss->flags & BF_SHOWN;
+		if (bssranked && (what & BP_LEVEL))
+			/* this publishes the complete BSS when it enters the ranking */
+			rank_bss(bss, 0);
+		if (!bssranked || shown)
+			publish_bss(bss, what);
+	} else if ((bss = add_ap(mac, freq, level, ssid)) != NULL) {
+		compute_flags(bss, flags);
+		if (bss->ssid)
+			compute_network_flags(bss, find_network_by_ssid(bss->ssid));
+		if (bssranked)
+			rank_bss(bss, 1);
+		else
+			publish_bss(bss, BP_ALL);
 	}
-	libt_remove_timeout(wpa_cmd_timeout, NULL);
-	if (!strcmp(line, "FAIL") || !strcmp(line, "UNKNOWN COMMAND")) {
-		if (!mystrncmp("STA-NEXT ", head->a) || !strcmp("STA-FIRST", head->a))
-			/* AP station discovery fails on end-of-list */
-			goto done;
+	if (bss)
+		bss->flags |= BF_PRESENT;
+	/* publish corresponding level */
+	if (!wif->curr_mode && !strcmp(wif->curr_bssid, bssid ?: ""))
+		publish_hyst(HY_LEVEL, level);
+	return id;
+}
 
-		mylog(LOG_WARNING, "'%s': %.30s", head->a,  line);
-		publish_failure("'%s': %.30s", strtok(head->a, " "), line);
-	} else if (!*line) {
-		mylog(LOG_INFO, "'%s': empty response", head->a);
-		/* empty reply */
-	} else if (!strcmp(head->a, "ATTACH")) {
-		mylog(LOG_NOTICE, "wpa connected");
+static void clear_topic(const char *topic)
+{
+	publish_value("", topic);
+}
 
-		wpa_send("LIST_NETWORKS");
-		wpa_send("SCAN_RESULTS");
-		wpa_send("STATUS");
-		wpa_send("SCAN");
+/* rewrite the state file while running, for after a crash */
+static void save_state(void *dat)
+{
+	snapshot_save();
+	libt_add_timeout(SNAPSHOT_PERIOD, save_state, dat);
+}
 
-	} else if (!mystrncmp("GET_NETWORK ", head->a)) {
-		int id;
-		char *name;
-		struct network *net;
+/* unsolicited events
+ * Each handler receives the arguments after the event name
+ */
+static void wpa_ev_connected(char *args)
+{
+	char *bssid;
+
+	/* - Connection to <bssid> completed ... */
+	strtok(args, " \t");
+	strtok(NULL, " \t");
+	strtok(NULL, " \t");
+	bssid = strtok(NULL, " \t");
+	conn_phase(CP_CONNECTED);
+	if (wif->conn_active && bssid && strlen(bssid) < sizeof(wif->conn_bssid))
+		strcpy(wif->conn_bssid, bssid);
+	if (!wif->curr_mode) {
+		/* only set station when not connected as AP */
+		set_wifi_state("station");
+		wpa_send("SIGNAL_POLL");
+		if (sigmon)
+			wpa_send("SIGNAL_MONITOR THRESHOLD=%i HYSTERESIS=%i",
+					sigmon_threshold, sigmon_hysteresis);
+	}
+	wpa_send("STATUS");
+}
 
-		strtok(head->a, " "); /* pop GET_NETWORK */
-		id = strtoul(strtok(NULL, " ") ?: "-1", NULL, 0);
-		name = strtok(NULL, " ") ?: "";
+static void wpa_ev_signal_change(char *args)
+{
+	char *tok, *val;
 
-		net = find_network_by_id(id);
-		if (!net)
-			goto done;
+	/* above=%i signal=%i noise=%i txrate=%lu */
+	for (tok = strtok(args, " \t"); tok; tok = strtok(NULL, " \t")) {
+		val = strchr(tok, '=');
+		if (!val)
+			continue;
+		*val++ = 0;
+		if (!strcmp(tok, "signal")) {
+			publish_hyst(HY_RSSI, strtol(val, NULL, 0));
+			if (!wif->curr_mode)
+				publish_hyst(HY_LEVEL, strtol(val, NULL, 0));
+		} else if (!strcmp(tok, "txrate"))
+			/* kbit/s to Mbit/s, like SIGNAL_POLL's LINKSPEED */
+			publish_hyst(HY_SPEED, strtoul(val, NULL, 0)/1000);
+	}
+}
 
-		if (!strcmp(name, "mode")) {
-			net->mode = strtoul(line, NULL, 0);
-			network_changed(net, 0);
-		} else if (!strcmp(name, "disabled")) {
-			if (strtoul(line, NULL, 0))
-				net->flags |= BF_DISABLED;
-			else
-				net->flags &= ~BF_DISABLED;
-			nets_enabled_changed();
-			network_changed(net, 0);
-		}
+static void wpa_ev_disconnected(char *args)
+{
+	if (wif->conn_active && (wif->conn_t[CP_AUTH] || wif->conn_t[CP_ASSOC]))
+		/* a disconnect before that ends the previous connection */
+		conn_done("disconnected");
+	wpa_send("STATUS");
+	set_wifi_state("none");
+}
 
-	} else if (!mystrncmp("SET_NETWORK ", head->a)) {
-		int id;
-		char *prop, *value;
-		struct network *net;
+/* connection progress, for the timeline */
+static void wpa_ev_trying(char *args)
+{
+	/* Trying to associate with <bssid> ... */
+	if (!strncmp(args, "to associate", 12))
+		conn_phase(CP_ASSOC);
+}
 
-		strtok(head->a, " "); /* pop SET_NETWORK */
-		id = strtoul(strtok(NULL, " ") ?: "-1", NULL, 0);
-		prop = strtok(NULL, " ") ?: "";
-		value = strtok(NULL, " ") ?: "";
+static void wpa_ev_sme(char *args)
+{
+	/* SME: Trying to authenticate with <bssid> ... */
+	if (!strncmp(args, "Trying to authenticate", 22))
+		conn_phase(CP_AUTH);
+}
 
-		net = find_network_by_id(id);
-		if (!net)
-			goto done;
+static void wpa_ev_associated(char *args)
+{
+	conn_phase(CP_ASSOCIATED);
+}
 
-		if (!strcmp(prop, "mode")) {
-			net->mode = strtoul(value, NULL, 0);
-			network_changed(net, 0);
-		} else if (!strcmp(prop, "disabled")) {
-			if (!strcmp(value, "1"))
-				net->flags |= BF_DISABLED;
-			else
-				net->flags &= ~BF_DISABLED;
-			nets_enabled_changed();
-			network_changed(net, 0);
-		}
-		wpa_save_config();
+static void wpa_ev_wpa(char *args)
+{
+	/* WPA: Key negotiation completed with <bssid> ... */
+	if (!strncmp(args, "Key negotiation completed", 25))
+		conn_phase(CP_HANDSHAKE);
+}
 
-	} else if (!strcmp("LIST_NETWORKS", head->a)) {
-		/* clear network list */
-		for (j = nnetworks; j > 0; --j)
-			remove_network(networks+j);
+static void wpa_ev_ap_enabled(char *args)
+{
+	wif->curr_mode = 2;
+	set_wifi_state("AP");
+	flush_stas();
+	set_wifi_stations(0);
+}
 
-		/* parse lines */
-		int id;
-		char *ssid;
-		struct network *net;
+static void wpa_ev_ap_disabled(char *args)
+{
+	wif->curr_mode = 0;
+	/* issue scan request immediately */
+	wpa_send("SCAN");
+	flush_stas();
+	set_wifi_stations(-1);
+}
 
-		for (line = strtok_r(line, "\r\n", &saveptr); line;
-				line = strtok_r(NULL, "\r\n", &saveptr)) {
-			if (!mystrncmp("network id", line))
-				/* header line */
-				continue;
-			id = strtoul(strtok(line, "\t"), NULL, 0);
-			ssid = strtok(NULL, "\t");
-			for (net = networks; net < networks+nnetworks; ++net) {
-				if (!strcmp(ssid, net->ssid ?: "")) {
-					/* remove duplicates */
-					wpa_send("REMOVE_NETWORK %i", id);
-					mylog(LOG_WARNING, "remove duplicate ssid '%s'", ssid);
-					goto listitem_done;
-				}
-			}
-			add_network(id, ssid);
-			wpa_send("GET_NETWORK %i disabled", id);
-			wpa_send("GET_NETWORK %i mode", id);
-listitem_done:;
-		}
-		sort_networks();
+static void wpa_ev_sta_connected(char *args)
+{
+	struct sta *sta = add_sta(strtok(args, " \t"));
 
-	} else if (!strcmp(head->a, "SCAN_RESULTS")) {
-		/* clear BF_PRESENT flag in bss list */
-		for (j = 0; j < nbsss; ++j)
-			bsss[j].flags &= ~BF_PRESENT;
-
-		/* parse lines */
-		char *bssid;
-		struct bss *bss;
-		for (line = strtok_r(line, "\r\n", &saveptr); line;
-				line = strtok_r(NULL, "\r\n", &saveptr)) {
-			if (!mystrncmp("bssid", line))
-				/* header line */
-				continue;
-			bssid = strtok(line, "\t");
-			/* process like 'hot-detected' bssid's */
-			wpa_send("BSS %s", bssid);
-			bss = find_ap_by_bssid(bssid);
-			/* mark bss as present */
-			if (bss)
-				bss->flags |= BF_PRESENT;
-		}
-		for (j = 0; j < nbsss; ) {
-			if (bsss[j].flags & BF_PRESENT) {
-				++j;
-				continue;
-			}
-			/* remove this bss */
-			hide_ap_mqtt(bsss[j].bssid);
-			remove_ap(bsss+j);
-		}
-		sort_ap();
-
-	} else if (!mystrncmp("BSS ", head->a)) {
-		char *bssid = NULL;
-		char *ssid = NULL;
-		char *flags = NULL;
-		int freq = 0, level = 0;
-		char *val;
-
-		for (line = strtok_r(line, "\r\n", &saveptr); line;
-				line = strtok_r(NULL, "\r\n", &saveptr)) {
-			tok = strtok(line, "=");
-			val = strtok(NULL, "=");
-
-			if (!strcmp(tok, "bssid"))
-				bssid = val;
-			else if (!strcmp(tok, "freq"))
-				freq = strtoul(val, NULL, 0);
-			else if (!strcmp(tok, "level"))
-				level = strtol(val, NULL, 0);
-			else if (!strcmp(tok, "flags"))
-				flags = val;
-			else if (!strcmp(tok, "ssid"))
-				ssid = val;
-		}
-		struct bss *bss;
+	if (sta && sta_poll_delay)
+		/* don't wait for the next poll */
+		wpa_send_bulk("STA %s", sta->addr);
+	set_wifi_stations(wif->nstas);
+}
 
-		if (ssid && !strncmp(ssid, "\\x00", 4))
-			/* ignore ssid's that start with \x00
-			 * it's most probably a hidden ssid */
-			goto done;
+static void wpa_ev_sta_disconnected(char *args)
+{
+	remove_sta(find_sta(strtok(args, " \t")));
+	set_wifi_stations(wif->nstas);
+}
 
-		bss = find_ap_by_bssid(bssid);
-		if (bss) {
-			if (bss->freq != freq)
-				publish_value(valuetostr("%.3lfG", freq*1e-3),
-						topicfmt("net/%s/bss/%s/freq", iface, bssid));
-			if (bss->level != level)
-				publish_value(valuetostr("%i", level),
-						topicfmt("net/%s/bss/%s/level", iface, bssid));
-			bss->freq = freq;
-			bss->level = level;
-			int savedflags = bss->flags;
-			compute_flags(bss, flags);
-			if (savedflags != bss->flags)
-				publish_value(bssflagsstr(bss),
-						topicfmt("net/%s/bss/%s/flags", iface, bssid));
-		} else if (bssid) {
-			struct bss *bss = add_ap(bssid, freq, level, ssid);
-
-			publish_value(ssid, topicfmt("net/%s/bss/%s/ssid", iface, bssid));
-			publish_value(valuetostr("%.3lfG", freq*1e-3),
-					topicfmt("net/%s/bss/%s/freq", iface, bssid));
-			publish_value(valuetostr("%i", level),
-					topicfmt("net/%s/bss/%s/level", iface, bssid));
-			/* publish flags as last */
-			compute_flags(bss, flags);
-			if (bss->ssid)
-				compute_network_flags(bss, find_network_by_ssid(bss->ssid));
-			publish_value(bssflagsstr(bss),
-					topicfmt("net/%s/bss/%s/flags", iface, bssid));
-			sort_ap();
-		}
-		/* publish corresponding level */
-		if (!curr_mode && !strcmp(curr_bssid, bssid ?: "")) {
-			if (level != curr_level)
-				publish_value(valuetostr("%i", level),
-						topicfmt("net/%s/level", iface));
-			curr_level = level;
-		}
-	} else if (!strcmp("SIGNAL_POLL", head->a)) {
-		char *val;
-
-		for (line = strtok_r(line, "\r\n", &saveptr); line;
-				line = strtok_r(NULL, "\r\n", &saveptr)) {
-			tok = strtok(line, "=");
-			val = strtok(NULL, "=");
-			if (!strcasecmp(tok, "rssi"))
-				publish_ivalue_if_different(val, &saved_rssi,
-						topicfmt("net/%s/rssi", iface));
-
-			else if (!strcasecmp(tok, "linkspeed"))
-				publish_ivalue_if_different(val, &saved_speed,
-						topicfmt("net/%s/speed", iface));
-		}
+static void wpa_ev_mesh_started(char *args)
+{
+	wif->curr_mode = 5;
+	set_wifi_state("mesh");
+	flush_stas();
+	set_wifi_stations(0);
+}
 
-	} else if (!strcmp("STATUS", head->a)) {
-		char *val;
-		char *ssid = NULL;
-		char *mode = NULL;
-		char *wpastate = NULL;
-		int freq = 0;
-
-		curr_bssid[0] = 0;
-		for (line = strtok_r(line, "\r\n", &saveptr); line;
-				line = strtok_r(NULL, "\r\n", &saveptr)) {
-			tok = strtok(line, "=");
-			val = strtok(NULL, "=");
-			if (!strcmp(tok, "bssid"))
-				strcpy(curr_bssid, val);
-			else if (!strcmp(tok, "ssid"))
-				ssid = val;
-			else if (!strcmp(tok, "freq"))
-				freq = strtoul(val, NULL, 0);
-			else if (!strcmp(tok, "mode"))
-				mode = val;
-			else if (!strcmp(tok, "wpa_state"))
-				wpastate = val;
-		}
-		if (!strcmp(curr_bssid, "00:00:00:00:00:00"))
-			curr_bssid[0] = 0;
+static void wpa_ev_mesh_removed(char *args)
+{
+	wif->curr_mode = 0;
+	flush_stas();
+	set_wifi_stations(-1);
+}
 
-		if (!pub_wifi_state) {
-			/* we just started, and this is the first iteration.
-			 * Fix curr_mode and wifi_state
-			 */
-			if (!strcmp(mode ?: "", "AP"))
-				curr_mode = 2;
-			else if (!strcmp(mode ?: "", "mesh"))
-				curr_mode = 5;
-
-			if (curr_mode == 2) {
-				set_wifi_state("AP");
-				wpa_send("STA-FIRST");
-				set_wifi_stations(0);
-			} else if (curr_mode == 5) {
-				set_wifi_state("mesh");
-			} else if (!strcmp(wpastate ?: "", "COMPLETED") && !strcmp(mode ?: "", "station")) {
-				set_wifi_state("station");
-				publish_value("", topicfmt("net/%s/stations", iface));
-			} else {
-				set_wifi_state("none");
-			}
-		}
+static void wpa_ev_bss_added(char *args)
+{
+	/* <id> <bssid> */
+	strtok(args, " \t");
+	wpa_send_bulk("BSS %s", strtok(NULL, " \t"));
+	wif->have_bss_events = 1;
+}
 
-		publish_value(curr_bssid, topicfmt("net/%s/bssid", iface));
-		if (freq && curr_mode) {
-			publish_value(valuetostr("%.3lfG",freq*1e-3),
-					topicfmt("net/%s/freq", iface));
-			publish_value("", topicfmt("net/%s/level", iface));
-			publish_value(ssid, topicfmt("net/%s/ssid", iface));
-		} else if (freq && curr_bssid[0]) {
-			publish_value(valuetostr("%.3lfG",freq*1e-3),
-					topicfmt("net/%s/freq", iface));
-			struct bss *bss = find_ap_by_bssid(curr_bssid);
-			if (bss) {
-				if (curr_level != bss->level)
-					publish_value(valuetostr("%i", bss->level),
-							topicfmt("net/%s/level", iface));
-				curr_level = bss->level;
-			}
-			publish_value(ssid, topicfmt("net/%s/ssid", iface));
-		} else {
-			publish_value("", topicfmt("net/%s/freq", iface));
-			publish_value("", topicfmt("net/%s/level", iface));
-			publish_value("", topicfmt("net/%s/ssid", iface));
-			curr_level = 0;
+static void wpa_ev_bss_removed(char *args)
+{
+	char *bssid;
+	struct bss *bss;
+
+	/* <id> <bssid> */
+	strtok(args, " \t");
+	bssid = strtok(NULL, " \t");
+	bss = find_ap_by_bssid(bssid);
+	if (bss) {
+		unpublish_bss(bss);
+		remove_ap(bss, 1);
+	} else
+		hide_ap_mqtt(bssid);
+	wif->have_bss_events = 1;
+}
+
+static void wpa_ev_scan_started(char *args)
+{
+	if (wif->scan_accepted)
+		/* time the scan, not the command queue */
+		wif->scan_t0 = mono_now();
+}
+
+static void wpa_ev_scan_results(char *args)
+{
+	if (wif->scan_accepted) {
+		wif->scan_accepted = 0;
+		wif->scan_time = mono_now() - wif->scan_t0;
+		/* SCAN_RESULTS holds the last scan only, count those,
+		 * not those of a SCAN_RESULTS sent before
+		 */
+		if (wpa_send_bulk("SCAN_RESULTS") >= 0)
+			last_queued->flags |= SF_SCANREQ;
+	}
+	if (!wif->have_bss_events)
+		wpa_scan_results();
+}
+
+/* networks that others added, but have no ssid yet */
+struct unnamed {
+	int id;
+	int tries;
+};
+
+#define UNNAMED_TRIES	10
+
+static void unnamed_poll(void *dat)
+{
+	int j;
+
+	wif = dat;
+	for (j = 0; j < wif->nunnamed; ) {
+		if (++wif->unnamed[j].tries > UNNAMED_TRIES) {
+			mylog(LOG_INFO, "network %i got no ssid", wif->unnamed[j].id);
+			wif->unnamed[j] = wif->unnamed[--wif->nunnamed];
+			continue;
 		}
+		wpa_send_bulk("GET_NETWORK %i ssid", wif->unnamed[j].id);
+		++j;
+	}
+	if (wif->nunnamed)
+		libt_add_timeout(1, unnamed_poll, dat);
+}
+
+static void add_unnamed(int id)
+{
+	int j;
+
+	for (j = 0; j < wif->nunnamed; ++j)
+		if (wif->unnamed[j].id == id)
+			return;
+	if (wif->nunnamed+1 > wif->sunnamed) {
+		wif->sunnamed += 16;
+		wif->unnamed = realloc(wif->unnamed, sizeof(*wif->unnamed)*wif->sunnamed);
+		if (!wif->unnamed)
+			mylog(LOG_ERR, "realloc %i unnamed: %s", wif->sunnamed, ESTR(errno));
+	}
+	wif->unnamed[wif->nunnamed].id = id;
+	wif->unnamed[wif->nunnamed].tries = 0;
+	++wif->nunnamed;
+	libt_add_timeout(1, unnamed_poll, wif);
+}
 
-	} else if (!strcmp("STA-FIRST", head->a)) {
-		/* initial stations request */
-		set_wifi_stations(1);
-		wpa_send("STA-NEXT %s", strtok(line, "\r\n"));
+static void remove_unnamed(int id)
+{
+	int j;
 
-	} else if (!strcmp("STA-NEXT", head->a)) {
-		/* subsequent station request */
-		set_wifi_stations(nstations+1);
-		wpa_send("STA-NEXT %s", strtok(line, "\r\n"));
+	for (j = 0; j < wif->nunnamed; ++j) {
+		if (wif->unnamed[j].id == id) {
+			wif->unnamed[j] = wif->unnamed[--wif->nunnamed];
+			break;
+		}
+	}
+	if (!wif->nunnamed)
+		libt_remove_timeout(unnamed_poll, wif);
+}
 
-	} else if (!mystrncmp("ADD_NETWORK", head->a)) {
-		struct network *net, *lp;
-		int id, npending;
+/* GET_NETWORK ID ssid returned VALUE, quoted or hex */
+static void wpa_network_appeared(int id, char *value)
+{
+	struct network *net;
+	char *ssid, hex[3] = {};
+	int j, len = strlen(value);
 
-		id = strtoul(line, NULL, 0);
-		/* find oldest id-less network */
-		for (net = NULL, npending = 0, lp = networks; lp < networks+nnetworks; ++lp) {
-			if (lp->id != -1)
-				continue;
-			++npending;
-			if (!net || lp->createseq < net->createseq)
-				net = lp;
+	if (len >= 2 && value[0] == '"' && value[len-1] == '"') {
+		value[len-1] = 0;
+		ssid = value+1;
+	} else {
+		for (j = 0; j+1 < len; j += 2) {
+			hex[0] = value[j];
+			hex[1] = value[j+1];
+			value[j/2] = strtoul(hex, NULL, 16);
 		}
-		if (npending <= 1)
-			/* reset counter, and avoid potential overflows. */
-			netcreateseq = 0;
-		if (!net)
-			goto done;
+		value[j/2] = 0;
+		ssid = value;
+	}
+	if (!*ssid)
+		/* not yet set, unnamed_poll retries */
+		return;
+	remove_unnamed(id);
+	if (find_network_by_id(id))
+		return;
+
+	net = find_network_by_ssid(ssid);
+	if (net && net->id < 0) {
+		/* created meanwhile, its ADD_NETWORK will be redundant */
 		net->id = id;
-		if (net->netflags & NF_REMOVE) {
+		network_created(net);
+		return;
+	} else if (net) {
+		wpa_send("REMOVE_NETWORK %i", id);
+		mylog(LOG_WARNING, "remove duplicate ssid '%s'", ssid);
+		return;
+	}
+	add_network(id, ssid);
+	sort_networks();
+	wpa_send("GET_NETWORK %i disabled", id);
+	wpa_send("GET_NETWORK %i mode", id);
+}
+
+static void wpa_ev_network_added(char *args)
+{
+	struct str *str;
+	int lane, id = strtoul(args, NULL, 0);
+
+	if (find_network_by_id(id))
+		/* ours, its ADD_NETWORK reply came first */
+		return;
+	/* the ADD_NETWORK reply with this id removes it again */
+	add_unnamed(id);
+	for_each_pending_cmd(str, lane) {
+		if (!strcmp(str->a, "ADD_NETWORK"))
+			/* probably ours, poll only if it is not */
+			return;
+	}
+	/* added by someone else */
+	wpa_send_bulk("GET_NETWORK %i ssid", id);
+}
+
+static void wpa_ev_network_removed(char *args)
+{
+	int id = strtoul(args, NULL, 0);
+	struct network *net = find_network_by_id(id);
+
+	remove_unnamed(id);
+	if (!net)
+		/* we removed it already */
+		return;
+	network_changed(net, 1);
+	remove_network(net);
+	nets_enabled_changed();
+}
+
+static const struct wpaevent {
+	const char *name;
+	void (*fn)(char *args);
+} wpaevents[] = {
+	{ "CTRL-EVENT-CONNECTED", wpa_ev_connected, },
+	{ "CTRL-EVENT-SIGNAL-CHANGE", wpa_ev_signal_change, },
+	{ "CTRL-EVENT-DISCONNECTED", wpa_ev_disconnected, },
+	{ "AP-ENABLED", wpa_ev_ap_enabled, },
+	{ "AP-DISABLED", wpa_ev_ap_disabled, },
+	{ "AP-STA-CONNECTED", wpa_ev_sta_connected, },
+	{ "AP-STA-DISCONNECTED", wpa_ev_sta_disconnected, },
+	{ "MESH-PEER-CONNECTED", wpa_ev_sta_connected, },
+	{ "MESH-PEER-DISCONNECTED", wpa_ev_sta_disconnected, },
+	{ "MESH-GROUP-STARTED", wpa_ev_mesh_started, },
+	{ "MESH-GROUP-REMOVED", wpa_ev_mesh_removed, },
+	{ "CTRL-EVENT-BSS-ADDED", wpa_ev_bss_added, },
+	{ "CTRL-EVENT-BSS-REMOVED", wpa_ev_bss_removed, },
+	{ "CTRL-EVENT-SCAN-STARTED", wpa_ev_scan_started, },
+	{ "CTRL-EVENT-SCAN-RESULTS", wpa_ev_scan_results, },
+	{ "CTRL-EVENT-NETWORK-ADDED", wpa_ev_network_added, },
+	{ "CTRL-EVENT-NETWORK-REMOVED", wpa_ev_network_removed, },
+	{ "Trying", wpa_ev_trying, },
+	{ "SME:", wpa_ev_sme, },
+	{ "Associated", wpa_ev_associated, },
+	{ "WPA:", wpa_ev_wpa, },
+};
+static struct phash wpaevent_hash;
+
+static void wpa_recvd_event(char *line)
+{
+	char topic[128];
+	int ret, len;
+
+	/* publish line to mqtt log,
+	 * don't use publish_value, it has hardcoded retain=1
+	 */
+	sprintf(topic, "tmp/%s/wpa", wif->iface);
+	ret = mosquitto_publish(mosq, NULL, topic, strlen(line), line, mqtt_qos, 0);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_publish %s: %s", topic, mosquitto_strerror(ret));
+
+	/* process value */
+	len = strcspn(line, " \t");
+	ret = phash_find(&wpaevent_hash, line, len);
+	if (ret >= 0)
+		wpaevents[ret].fn(line + len + !!line[len]);
+}
+
+/* command replies
+ * Each handler receives its command, and the reply from line to end.
+ * FAIL and empty replies are handled before.
+ */
+static void wpa_recvd_attach(struct str *head, char *line, char *end)
+{
+	struct str *str;
+	int nadd, lane, j;
+
+	mylog(LOG_NOTICE, "wpa connected");
+
+	wpa_send("LIST_NETWORKS");
+	/* networks created while reconnecting still need an id */
+	for (nadd = 0, j = 0; j < wif->nnetworks; ++j)
+		nadd += wif->networks[j].id < 0;
+	for_each_pending_cmd(str, lane)
+		nadd -= !strcmp(str->a, "ADD_NETWORK");
+	for (; nadd > 0; --nadd)
+		wpa_send("ADD_NETWORK");
+	wpa_scan_results();
+	wpa_send("STATUS");
+	wpa_send("SCAN");
+}
+
+static void wpa_recvd_get_network(struct str *head, char *line, char *end)
+{
+	int id;
+	char *name;
+	struct network *net;
+
+	strtok(head->a, " "); /* pop GET_NETWORK */
+	id = strtoul(strtok(NULL, " ") ?: "-1", NULL, 0);
+	name = strtok(NULL, " ") ?: "";
+
+	if (!strcmp(name, "ssid")) {
+		wpa_network_appeared(id, line);
+		return;
+	}
+	net = find_network_by_id(id);
+	if (!net)
+		return;
+
+	if (!strcmp(name, "mode")) {
+		net->mode = strtoul(line, NULL, 0);
+		net->netflags |= NF_MODE;
+		network_changed(net, 0);
+	} else if (!strcmp(name, "disabled")) {
+		if (strtoul(line, NULL, 0))
+			net->flags |= BF_DISABLED;
+		else
+			net->flags &= ~BF_DISABLED;
+		nets_enabled_changed();
+		network_changed(net, 0);
+	}
+}
+
+static void wpa_recvd_set_network(struct str *head, char *line, char *end)
+{
+	int id;
+	char *prop, *value;
+	struct network *net;
+
+	strtok(head->a, " "); /* pop SET_NETWORK */
+	id = strtoul(strtok(NULL, " ") ?: "-1", NULL, 0);
+	prop = strtok(NULL, " ") ?: "";
+	value = strtok(NULL, " ") ?: "";
+
+	net = find_network_by_id(id);
+	if (!net)
+		return;
+
+	if (!strcmp(prop, "mode")) {
+		net->mode = strtoul(value, NULL, 0);
+		net->netflags |= NF_MODE;
+		network_changed(net, 0);
+	} else if (!strcmp(prop, "disabled")) {
+		if (!strcmp(value, "1"))
+			net->flags |= BF_DISABLED;
+		else
+			net->flags &= ~BF_DISABLED;
+		nets_enabled_changed();
+		network_changed(net, 0);
+	}
+	wpa_save_config();
+}
+
+static void wpa_recvd_list_networks(struct str *head, char *line, char *end)
+{
+	/* reconcile with the networks we hold */
+	int id, j, disabled;
+	char *ssid, *str, *pos;
+	struct network *net;
+
+	for (net = wif->networks; net < wif->networks+wif->nnetworks; ++net)
+		if (net->id >= 0)
+			net->netflags |= NF_STALE;
+
+	for (pos = line; (line = next_line(&pos, end)) != NULL; ) {
+		if (!*line || !mystrncmp("network id", line))
+			/* header line */
+			continue;
+		/* id, ssid, bssid, flags */
+		str = line;
+		id = strtoul(strsep(&str, "\t"), NULL, 0);
+		ssid = strsep(&str, "\t") ?: "";
+		strsep(&str, "\t");
+		disabled = str && strstr(str, "[DISABLED]");
+		net = find_network_by_ssid(ssid);
+		if (!net) {
+			net = add_network(id, ssid);
+			sort_networks();
+			net = find_network_by_ssid(ssid);
+		} else if (net->netflags & NF_STALE) {
+			/* known network, wpa_supplicant may have renumbered */
+			net->netflags &= ~NF_STALE;
+			net->id = id;
+		} else if (net->id < 0) {
+			/* created meanwhile, its ADD_NETWORK will be redundant */
+			net->id = id;
+			network_created(net);
+			continue;
+		} else {
+			/* remove duplicates */
 			wpa_send("REMOVE_NETWORK %i", id);
+			mylog(LOG_WARNING, "remove duplicate ssid '%s'", ssid);
+			continue;
+		}
+		if (!!(net->flags & BF_DISABLED) != disabled) {
+			net->flags ^= BF_DISABLED;
+			network_changed(net, 0);
+		}
+		if (!(net->netflags & NF_MODE))
+			/* only what LIST_NETWORKS does not tell */
+			wpa_send("GET_NETWORK %i mode", id);
+	}
+	/* drop networks that disappeared */
+	for (j = 0; j < wif->nnetworks; ) {
+		net = wif->networks+j;
+		if (net->netflags & NF_STALE) {
 			network_changed(net, 1);
 			remove_network(net);
-			nets_enabled_changed();
-			goto done;
+		} else
+			++j;
+	}
+	nets_enabled_changed();
+}
+
+/* report a scan that was requested via MQTT */
+static void wpa_scan_done(const char *line, const char *end)
+{
+	int ret, nresults = 0;
+	char topic[128], value[64];
+
+	/* 1 header line, and the last newline is stripped already */
+	for (; (line = memchr(line, '\n', end - line)) != NULL; ++line)
+		++nresults;
+
+	sprintf(topic, "net/%s/scan/done", wif->iface);
+	sprintf(value, "duration=%.3lf results=%i", wif->scan_time, nresults);
+	ret = mosquitto_publish(mosq, NULL, topic, strlen(value), value, mqtt_qos, 0);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_publish %s: %s", topic, mosquitto_strerror(ret));
+}
+
+static void wpa_recvd_scan_results(struct str *head, char *line, char *end)
+{
+	int j;
+	char *bssid, *pos, *tab;
+	struct bss *bss;
+
+	if (head->flags & SF_SCANREQ) {
+		wpa_scan_done(line, end);
+		if (wif->have_bss_events || bulkbss)
+			/* the BSS events, or BSS RANGE, maintain the table */
+			return;
+	}
+	/* clear BF_PRESENT flag in bss list */
+	for (j = 0; j < wif->nbsss; ++j)
+		wif->bsss[j].flags &= ~BF_PRESENT;
+
+	/* parse lines */
+	for (pos = line; (bssid = next_line(&pos, end)) != NULL; ) {
+		if (!*bssid || !mystrncmp("bssid", bssid))
+			/* header line */
+			continue;
+		tab = strchr(bssid, '\t');
+		if (tab)
+			*tab = 0;
+		/* process like 'hot-detected' bssid's */
+		wpa_send_bulk("BSS %s", bssid);
+		bss = find_ap_by_bssid(bssid);
+		/* mark bss as present */
+		if (bss)
+			bss->flags |= BF_PRESENT;
+	}
+	wpa_sweep_bss();
+}
+
+static void wpa_recvd_bss(struct str *head, char *line, char *end)
+{
+	char *next, *recend;
+	int id, lastid = -1;
+
+	if (mystrncmp("BSS RANGE=", head->a)) {
+		wpa_bss_info(line, end);
+		return;
+	}
+	/* records are separated with '====' lines */
+	for (; line; line = next) {
+		next = !mystrncmp("====", line) ? line : strstr(line, "\n====");
+		recend = next ?: end;
+		if (next) {
+			*next = 0;
+			/* skip the remainder of the delimiter line */
+			next = strchr(next+1, '\n');
+			if (next)
+				++next;
 		}
+		if (!*line)
+			continue;
+		id = wpa_bss_info(line, recend);
+		if (id > lastid)
+			lastid = id;
+	}
+	if (lastid >= 0)
+		/* continue after the last record, the reply may have been cut */
+		wpa_send_bulk("BSS RANGE=%i- MASK=0x%x", lastid+1, BSS_BULK_MASK);
+	else {
+		wif->bss_bulk_busy = 0;
+		wpa_sweep_bss();
+	}
+}
+
+static void wpa_recvd_signal_poll(struct str *head, char *line, char *end)
+{
+	struct kv kv;
+
+	while (next_kv(&line, end, &kv))
+	switch (kv.hash) {
+	case KVHASH(4, 'r', 'i'):
+		if (KVIS(&kv, "RSSI"))
+			publish_hyst(HY_RSSI, strtol(kv.val, NULL, 0));
+		break;
+	case KVHASH(9, 'l', 'd'):
+		if (KVIS(&kv, "LINKSPEED"))
+			publish_hyst(HY_SPEED, strtol(kv.val, NULL, 0));
+		break;
+	}
+}
+
+static void wpa_recvd_status(struct str *head, char *line, char *end)
+{
+	struct kv kv;
+	char *ssid = NULL;
+	char *mode = NULL;
+	char *wpastate = NULL;
+	int freq = 0, prev_mode;
+
+	wif->curr_bssid[0] = 0;
+	while (next_kv(&line, end, &kv))
+	switch (kv.hash) {
+	case KVHASH(5, 'b', 'd'):
+		if (KVIS(&kv, "bssid") && kv.vallen < sizeof(wif->curr_bssid))
+			strcpy(wif->curr_bssid, kv.val);
+		break;
+	case KVHASH(4, 's', 'd'):
+		if (KVIS(&kv, "ssid"))
+			ssid = kv.val;
+		break;
+	case KVHASH(4, 'f', 'q'):
+		if (KVIS(&kv, "freq"))
+			freq = strtoul(kv.val, NULL, 0);
+		break;
+	case KVHASH(4, 'm', 'e'):
+		if (KVIS(&kv, "mode"))
+			mode = kv.val;
+		break;
+	case KVHASH(9, 'w', 'e'):
+		if (KVIS(&kv, "wpa_state"))
+			wpastate = kv.val;
+		break;
+	}
+	if (!strcmp(wif->curr_bssid, "00:00:00:00:00:00"))
+		wif->curr_bssid[0] = 0;
+
+	if (!wif->wpa_synced) {
+		/* we just (re)connected, and this is the first iteration.
+		 * Fix curr_mode and wifi_state
+		 */
+		wif->wpa_synced = 1;
+		prev_mode = wif->curr_mode;
+		if (!strcmp(mode ?: "", "AP"))
+			wif->curr_mode = 2;
+		else if (!strcmp(mode ?: "", "mesh"))
+			wif->curr_mode = 5;
+		else
+			wif->curr_mode = 0;
+		if (wif->curr_mode != prev_mode)
+			/* the stations or peers of the mode we left */
+			flush_stas();
+
+		if (wif->curr_mode == 2) {
+			set_wifi_state("AP");
+			wpa_sta_enumerate();
+		} else if (wif->curr_mode == 5) {
+			set_wifi_state("mesh");
+		} else if (!strcmp(wpastate ?: "", "COMPLETED") && !strcmp(mode ?: "", "station")) {
+			set_wifi_state("station");
+			if (sigmon)
+				/* a new wpa_supplicant forgot our monitor */
+				wpa_send("SIGNAL_MONITOR THRESHOLD=%i HYSTERESIS=%i",
+						sigmon_threshold, sigmon_hysteresis);
+		} else {
+			set_wifi_state("none");
+		}
+		if (wif->curr_mode != 2 && wif->curr_mode != 5)
+			set_wifi_stations(-1);
+	}
+
+	publish_svalue_if_different(wif->curr_bssid, &wif->saved_bssid, topicfmt("net/%s/bssid", wif->iface));
+	if (freq && wif->curr_mode) {
+		publish_svalue_if_different(valuetostr("%.3lfG",freq*1e-3), &wif->saved_freq,
+				topicfmt("net/%s/freq", wif->iface));
+		clear_hyst(HY_LEVEL);
+		publish_svalue_if_different(ssid, &wif->saved_ssid, topicfmt("net/%s/ssid", wif->iface));
+	} else if (freq && wif->curr_bssid[0]) {
+		publish_svalue_if_different(valuetostr("%.3lfG",freq*1e-3), &wif->saved_freq,
+				topicfmt("net/%s/freq", wif->iface));
+		struct bss *bss = find_ap_by_bssid(wif->curr_bssid);
+		if (bss)
+			set_hyst(HY_LEVEL, bss->level);
+		publish_svalue_if_different(ssid, &wif->saved_ssid, topicfmt("net/%s/ssid", wif->iface));
+	} else {
+		publish_svalue_if_different("", &wif->saved_freq, topicfmt("net/%s/freq", wif->iface));
+		clear_hyst(HY_LEVEL);
+		publish_svalue_if_different("", &wif->saved_ssid, topicfmt("net/%s/ssid", wif->iface));
+	}
+	if (!strcmp(wpastate ?: "", "COMPLETED"))
+		/* the connection is published */
+		conn_phase(CP_STATUS);
+}
 
-		wpa_send("SET_NETWORK %i ssid \"%s\"", id, net->ssid);
-		for (j = 0; j < net->ncfgs; j += 2)
-			wpa_send("SET_NETWORK %i %s %s", id, net->cfgs[j], net->cfgs[j+1]);
-		remove_network_configs(net);
+static void wpa_recvd_sta_next(struct str *head, char *line, char *end)
+{
+	struct sta *sta = wpa_sta_info(line, end);
 
-		if (net->netflags & NF_SEL)
-			wpa_send("SELECT_NETWORK %i", id);
-		else if (!(net->flags & BF_DISABLED))
-			/* enable station-mode networks automatically */
-			wpa_send("ENABLE_NETWORK %i", id);
-		nets_enabled_changed();
+	if (sta)
+		wpa_send_bulk("STA-NEXT %s", sta->addr);
+	else
+		wpa_sta_enumerated();
+}
+
+static void wpa_recvd_sta(struct str *head, char *line, char *end)
+{
+	wpa_sta_info(line, end);
+}
+
+static void wpa_recvd_add_network(struct str *head, char *line, char *end)
+{
+	struct network *net, *lp;
+	int id, npending;
+
+	id = strtoul(line, NULL, 0);
+	/* its NETWORK-ADDED event may have arrived before */
+	remove_unnamed(id);
+	/* find oldest id-less network */
+	for (net = NULL, npending = 0, lp = wif->networks; lp < wif->networks+wif->nnetworks; ++lp) {
+		if (lp->id != -1)
+			continue;
+		++npending;
+		if (!net || lp->createseq < net->createseq)
+			net = lp;
+	}
+	if (npending <= 1)
+		/* reset counter, and avoid potential overflows. */
+		wif->netcreateseq = 0;
+	if (!net) {
+		/* LIST_NETWORKS found the network already */
+		wpa_send("REMOVE_NETWORK %i", id);
+		return;
+	}
+	net->id = id;
+	network_created(net);
+}
 
-	} else if (!mystrncmp("ENABLE_NETWORK all", head->a)) {
-		for (j = 0; j < nnetworks; ++j) {
-			if (networks[j].flags & BF_DISABLED) {
-				networks[j].flags &= ~BF_DISABLED;
-				network_changed(networks+j, 0);
+static void wpa_recvd_enable_network(struct str *head, char *line, char *end)
+{
+	int j, enable = head->a[0] == 'E';
+	struct network *net;
+	/* skip the verb */
+	const char *arg = head->a + (enable ? 15 : 16);
+
+	if (!strcmp(arg, "all")) {
+		for (j = 0; j < wif->nnetworks; ++j) {
+			if (!!(wif->networks[j].flags & BF_DISABLED) == enable) {
+				wif->networks[j].flags ^= BF_DISABLED;
+				network_bss_changed(wif->networks+j, 0);
 			}
 		}
+		update_last_ap(NULL);
 		wpa_save_config();
 		nets_enabled_changed();
-
-	} else if (!mystrncmp("DISABLE_NETWORK all", head->a)) {
-		for (j = 0; j < nnetworks; ++j) {
-			if (!(networks[j].flags & BF_DISABLED)) {
-				networks[j].flags |= BF_DISABLED;
-				network_changed(networks+j, 0);
-			}
-		}
+		return;
+	}
+	net = find_network_by_id(strtoul(arg, NULL, 0));
+	if (net) {
+		if (enable)
+			net->flags &= ~BF_DISABLED;
+		else
+			net->flags |= BF_DISABLED;
+		network_changed(net, 0);
 		wpa_save_config();
 		nets_enabled_changed();
+	}
+}
 
-	} else if (!mystrncmp("ENABLE_NETWORK ", head->a)) {
-		int idx = strtoul(head->a + 15, NULL, 0);
-		struct network *net = find_network_by_id(idx);
+static void wpa_recvd_select_network(struct str *head, char *line, char *end)
+{
+	int idx = strtoul(head->a + 15, NULL, 0);
+	struct network *net;
 
-		if (net) {// && (net->flags & BF_DISABLED)) {
+	for (net = wif->networks; net < wif->networks+wif->nnetworks; ++net) {
+		if (net->id == idx)
 			net->flags &= ~BF_DISABLED;
-			network_changed(net, 0);
-			wpa_save_config();
-			nets_enabled_changed();
-		}
+		else
+			net->flags |= BF_DISABLED;
+		network_bss_changed(net, 0);
+	}
+	update_last_ap(NULL);
+	wpa_save_config();
+	nets_enabled_changed();
+}
 
-	} else if (!mystrncmp("DISABLE_NETWORK ", head->a)) {
-		int idx = strtoul(head->a + 16, NULL, 0);
-		struct network *net = find_network_by_id(idx);
+static void wpa_recvd_save_config(struct str *head, char *line, char *end)
+{
+	/* REMOVE_NETWORK & SET */
+	wpa_save_config();
+}
 
-		if (net) {// && !(net->flags & BF_DISABLED)) {
-			net->flags |= BF_DISABLED;
-			network_changed(net, 0);
-			wpa_save_config();
-			nets_enabled_changed();
-		}
+static void wpa_recvd_ignore(struct str *head, char *line, char *end)
+{
+}
 
-	} else if (!mystrncmp("REMOVE_NETWORK ", head->a)) {
-		wpa_save_config();
+static void wpa_recvd_scan(struct str *head, char *line, char *end)
+{
+	if (!mystrncmp("FAIL", line)) {
+		/* FAIL-BUSY, a plain FAIL is handled already */
+		mylog(LOG_INFO, "'%s': %.30s", head->a, line);
+		if (!(head->flags & SF_SCANREQ))
+			/* our own SCAN, wpa_supplicant is scanning anyway */
+			return;
+		publish_failure("'SCAN': %.30s", line);
+	} else if (head->flags & SF_SCANREQ) {
+		/* the next scan is ours */
+		wif->scan_accepted = 1;
+		wif->scan_t0 = mono_now();
+	}
+}
 
-	} else if (!mystrncmp("SELECT_NETWORK ", head->a)) {
-		int idx = strtoul(head->a + 15, NULL, 0);
-		struct network *net;
+static const struct wpareply {
+	const char *verb;
+	void (*fn)(struct str *head, char *line, char *end);
+} wpareplies[] = {
+	{ "ATTACH", wpa_recvd_attach, },
+	{ "GET_NETWORK", wpa_recvd_get_network, },
+	{ "SET_NETWORK", wpa_recvd_set_network, },
+	{ "LIST_NETWORKS", wpa_recvd_list_networks, },
+	{ "SCAN_RESULTS", wpa_recvd_scan_results, },
+	{ "BSS", wpa_recvd_bss, },
+	{ "SIGNAL_POLL", wpa_recvd_signal_poll, },
+	{ "STATUS", wpa_recvd_status, },
+	{ "STA-FIRST", wpa_recvd_sta_next, },
+	{ "STA-NEXT", wpa_recvd_sta_next, },
+	{ "STA", wpa_recvd_sta, },
+	{ "ADD_NETWORK", wpa_recvd_add_network, },
+	{ "ENABLE_NETWORK", wpa_recvd_enable_network, },
+	{ "DISABLE_NETWORK", wpa_recvd_enable_network, },
+	{ "SELECT_NETWORK", wpa_recvd_select_network, },
+	{ "REMOVE_NETWORK", wpa_recvd_save_config, },
+	{ "SET", wpa_recvd_save_config, },
+	{ "PING", wpa_recvd_ignore, },
+	{ "SCAN", wpa_recvd_scan, },
+};
+/* reply handler per verb, indexed like cmdverbs */
+static void (*cmdreplies[NCMDVERBS])(struct str *head, char *line, char *end);
 
-		for (net = networks; net < networks+nnetworks; ++net) {
-			if (net->id == idx)
-				net->flags &= ~BF_DISABLED;
-			else
-				net->flags |= BF_DISABLED;
-			network_changed(net, 0);
+static void wpa_init_dispatch(void)
+{
+	int j, verb;
+
+	phash_init(&cmdverb_hash, cmdverbs, sizeof(cmdverbs[0]), NCMDVERBS-1);
+	phash_init(&wpaevent_hash, wpaevents, sizeof(wpaevents[0]),
+			sizeof(wpaevents)/sizeof(wpaevents[0]));
+	for (j = 0; j < sizeof(wpareplies)/sizeof(wpareplies[0]); ++j) {
+		verb = cmdverb(wpareplies[j].verb);
+		if (verb >= NCMDVERBS-1)
+			mylog(LOG_ERR, "no command verb '%s'", wpareplies[j].verb);
+		cmdreplies[verb] = wpareplies[j].fn;
+	}
+}
+
+/* the initial sync of all interfaces completed,
+ * what remains in the snapshot is stale
+ */
+static void wpa_sweep_state(void)
+{
+	struct wif *saved = wif;
+	int j;
+
+	if (!statefile || state_swept)
+		return;
+	for (j = 0; j < nwifs; ++j)
+		if (wifs[j].strq || !wifs[j].wpa_synced)
+			return;
+	state_swept = 1;
+	for (j = 0; j < nwifs; ++j) {
+		if (wifs[j].bsstable_dirty) {
+			libt_remove_timeout(publish_bsstable, wifs+j);
+			publish_bsstable(wifs+j);
 		}
-		wpa_save_config();
-		nets_enabled_changed();
+	}
+	wif = saved;
+	snapshot_sweep(clear_topic);
+}
 
-	} else if (!strcmp("PING", head->a)) {
-		/* ignore */
-	} else if (!mystrncmp("SET ", head->a)) {
-		wpa_save_config();
+static void wpa_recvd_pkt(char *line)
+{
+	int ret;
+	char *nl, *end;
+	struct str *head;
+
+	ret = strlen(line);
+	if (ret && line[ret-1] == '\n')
+		line[--ret] = 0;
+	end = line+ret;
+	/* prepare log */
+	nl = strchr(line, '\n');
+	mylog(LOG_DEBUG, "< %.*s%s", (int)(nl ? nl - line : strlen(line)), line, nl ? " ..." : "");
+
+	if (!mystrncmp("<2>", line) || !mystrncmp("<3>", line) || !mystrncmp("<4>", line)) {
+		wpa_recvd_event(line+3);
+		return;
+	}
+	head = pop_strq();
+	if (!head) {
+		mylog(LOG_WARNING, "unsolicited response '%s'", line);
+		return;
+	}
+	/* the next command in flight is still timed */
+	wpa_arm_cmd_timeout();
+	cmd_timing(head);
+	if (!mystrncmp("BSS RANGE=", head->a) && (!*line || !strcmp(line, "FAIL"))) {
+		/* end of bulk BSS series */
+		wif->bss_bulk_busy = 0;
+		wpa_sweep_bss();
+
+	} else if ((!*line || !strcmp(line, "FAIL")) &&
+			(!mystrncmp("STA-NEXT ", head->a) || !strcmp("STA-FIRST", head->a))) {
+		/* end of AP station discovery */
+		wpa_sta_enumerated();
+
+	} else if (!strcmp(line, "FAIL") || !strcmp(line, "UNKNOWN COMMAND")) {
+		if (!mystrncmp("STA ", head->a) || (!mystrncmp("GET_NETWORK ", head->a) &&
+					!strcmp(strrchr(head->a, ' '), " ssid")))
+			/* station left meanwhile,
+			 * or an unnamed network has no ssid yet or left
+			 */
+			goto done;
 
+		mylog(LOG_WARNING, "'%s': %.30s", head->a,  line);
+		publish_failure("'%s': %.30s", strtok(head->a, " "), line);
+	} else if (!*line) {
+		mylog(LOG_INFO, "'%s': empty response", head->a);
+		/* empty reply */
+	} else if (cmdreplies[head->verb]) {
+		cmdreplies[head->verb](head, line, end);
 	} else {
 		mylog(LOG_INFO, "'%.20s' OK", head->a);
 	}
 done:
-	free(head);
+	put_str(head);
+	/* the reply freed a slot in the window */
+	wpa_send_queued();
+	wpa_sweep_state();
+}
+
+/* receive buffer, sized to the largest datagram so far */
+static char *rxbuf;
+static int srxbuf;
+
+static int wpa_recv(void)
+{
+	int ret;
+	struct iovec iov;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	/* peek the real datagram size */
+	ret = recv(wif->wpasock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	if (ret < 0)
+		return ret;
+	if (ret+1 > srxbuf) {
+		srxbuf = (ret+1+4095) & ~4095;
+		rxbuf = realloc(rxbuf, srxbuf);
+		if (!rxbuf)
+			mylog(LOG_ERR, "realloc %i: %s", srxbuf, ESTR(errno));
+	}
+	iov.iov_base = rxbuf;
+	iov.iov_len = srxbuf-1;
+	ret = recvmsg(wif->wpasock, &msg, 0);
+	if (ret < 0)
+		return ret;
+	if (msg.msg_flags & MSG_TRUNC) {
+		++wif->ntruncated;
+		mylog(LOG_WARNING, "wpa datagram truncated to %i bytes", ret);
+		publish_diag("truncated", valuetostr("%i", wif->ntruncated));
+	}
+	rxbuf[ret] = 0;
+	return ret;
 }
 
-static int wpa_connect(const char *iface)
+static int wpa_connect(int fatal)
 {
 	int ret, sock;
 	struct sockaddr_un name = {
 		.sun_family = AF_UNIX,
 	};
+	/* failing to reconnect is not fatal, and would flood the log */
+	int loglevel = fatal ? LOG_ERR : LOG_DEBUG;
 
 	/* open client socket */
 	ret = sock = socket(PF_UNIX, SOCK_DGRAM, 0);
-	if (ret < 0)
-		mylog(LOG_ERR, "socket unix: %s", ESTR(errno));
+	if (ret < 0) {
+		mylog(loglevel, "socket unix: %s", ESTR(errno));
+		return -1;
+	}
 	/* connect to server */
-	sprintf(name.sun_path, "/var/run/wpa_supplicant/%s", iface);
+	if (snprintf(name.sun_path, sizeof(name.sun_path), "%s/%s", ctrl_dir, wif->iface)
+			>= sizeof(name.sun_path)) {
+		mylog(loglevel, "path %s/%s too long", ctrl_dir, wif->iface);
+		goto fail;
+	}
 	ret = connect(sock, (struct sockaddr *)&name, SUN_LEN(&name));
-	if (ret < 0)
-		mylog(LOG_ERR, "connect %s: %s", name.sun_path, ESTR(errno));
+	if (ret < 0) {
+		mylog(loglevel, "connect %s: %s", name.sun_path, ESTR(errno));
+		goto fail;
+	}
 
 	/* bind to abstract name */
 	memset(name.sun_path, 0, sizeof(name.sun_path));
-	sprintf(name.sun_path+1, "wpa-mqtt-%s-%i", iface, getpid());
+	sprintf(name.sun_path+1, "wpa-mqtt-%s-%i", wif->iface, getpid());
 	ret = bind(sock, (struct sockaddr *)&name, sizeof(name));
-	if (ret < 0)
-		mylog(LOG_ERR, "bind @%s: %s", name.sun_path+1, ESTR(errno));
+	if (ret < 0) {
+		mylog(loglevel, "bind @%s: %s", name.sun_path+1, ESTR(errno));
+		goto fail;
+	}
 	return sock;
+fail:
+	close(sock);
+	return -1;
+}
+
+#ifdef NOPLAINPSK
+/* PSK derivation runs in a worker thread,
+ * results are collected via pskfd in the main loop
+ */
+struct pskjob {
+	struct pskjob *next;
+	/* the interface that requested it */
+	struct wif *wif;
+	char *ssid;
+	char *passphrase;
+	uint8_t hash[SHA256_DIGEST_LENGTH];
+	char textpsk[65];
+	int ok;
+};
+
+static pthread_mutex_t psk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t psk_cond = PTHREAD_COND_INITIALIZER;
+static struct pskjob *psk_todo, *psk_todolast;
+static struct pskjob *psk_done, *psk_donelast;
+static int pskfd = -1;
+
+/* derived keys, indexed on (ssid, passphrase hash) */
+#define NPSKCACHE	16
+static struct pskcache {
+	char *ssid;
+	uint8_t hash[SHA256_DIGEST_LENGTH];
+	char textpsk[65];
+	unsigned int stamp;
+} pskcache[NPSKCACHE];
+static unsigned int pskstamp;
+
+static struct pskcache *psk_cache_lookup(const char *ssid, const uint8_t *hash)
+{
+	struct pskcache *pc;
+
+	for (pc = pskcache; pc < pskcache+NPSKCACHE; ++pc) {
+		if (pc->ssid && !strcmp(pc->ssid, ssid) &&
+				!memcmp(pc->hash, hash, sizeof(pc->hash))) {
+			pc->stamp = ++pskstamp;
+			return pc;
+		}
+	}
+	return NULL;
+}
+
+static void psk_cache_add(const struct pskjob *job)
+{
+	struct pskcache *pc, *lru = pskcache;
+
+	if (psk_cache_lookup(job->ssid, job->hash))
+		return;
+	/* replace the least recently used entry */
+	for (pc = pskcache; pc < pskcache+NPSKCACHE; ++pc) {
+		if (pc->stamp < lru->stamp)
+			lru = pc;
+	}
+	myfree(lru->ssid);
+	lru->ssid = strdup(job->ssid);
+	memcpy(lru->hash, job->hash, sizeof(lru->hash));
+	strcpy(lru->textpsk, job->textpsk);
+	lru->stamp = ++pskstamp;
+}
+
+static void *psk_worker(void *dat)
+{
+	struct pskjob *job;
+	uint8_t binpsk[32];
+	uint64_t one = 1;
+	int j;
+
+	for (;;) {
+		pthread_mutex_lock(&psk_mutex);
+		while (!psk_todo)
+			pthread_cond_wait(&psk_cond, &psk_mutex);
+		job = psk_todo;
+		psk_todo = job->next;
+		if (!psk_todo)
+			psk_todolast = NULL;
+		pthread_mutex_unlock(&psk_mutex);
+
+		job->ok = PKCS5_PBKDF2_HMAC_SHA1(job->passphrase, strlen(job->passphrase),
+				(const void *)job->ssid, strlen(job->ssid),
+				4096, sizeof(binpsk), binpsk);
+		/* convert to text */
+		for (j = 0; j < sizeof(binpsk); ++j)
+			sprintf(job->textpsk+j*2, "%02x", binpsk[j]);
+
+		pthread_mutex_lock(&psk_mutex);
+		job->next = NULL;
+		if (psk_donelast)
+			psk_donelast->next = job;
+		else
+			psk_done = job;
+		psk_donelast = job;
+		pthread_mutex_unlock(&psk_mutex);
+		if (write(pskfd, &one, sizeof(one)) < 0)
+			mylog(LOG_ERR, "write eventfd: %s", ESTR(errno));
+	}
+	return NULL;
+}
+
+static void psk_init(void)
+{
+	pthread_t thr;
+	int ret;
+
+	pskfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pskfd < 0)
+		mylog(LOG_ERR, "eventfd: %s", ESTR(errno));
+	ret = pthread_create(&thr, NULL, psk_worker, NULL);
+	if (ret)
+		mylog(LOG_ERR, "pthread_create: %s", ESTR(ret));
+	pthread_detach(thr);
+}
+
+/* create the psk for ssid,
+ * return the cached psk or NULL when queued for derivation
+ */
+static const char *psk_derive(const char *ssid, const char *passphrase)
+{
+	struct pskjob *job;
+	struct pskcache *pc;
+	uint8_t hash[SHA256_DIGEST_LENGTH];
+
+	SHA256((const void *)passphrase, strlen(passphrase), hash);
+	pc = psk_cache_lookup(ssid, hash);
+	if (pc)
+		return pc->textpsk;
+
+	job = malloc(sizeof(*job));
+	if (!job)
+		mylog(LOG_ERR, "malloc pskjob: %s", ESTR(errno));
+	memset(job, 0, sizeof(*job));
+	job->wif = wif;
+	job->ssid = strdup(ssid);
+	job->passphrase = strdup(passphrase);
+	memcpy(job->hash, hash, sizeof(hash));
+
+	pthread_mutex_lock(&psk_mutex);
+	if (psk_todolast)
+		psk_todolast->next = job;
+	else
+		psk_todo = job;
+	psk_todolast = job;
+	pthread_cond_signal(&psk_cond);
+	pthread_mutex_unlock(&psk_mutex);
+	return NULL;
 }
 
+static void psk_collect(void)
+{
+	struct pskjob *job;
+	uint64_t cnt;
+
+	if (read(pskfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		mylog(LOG_ERR, "read eventfd: %s", ESTR(errno));
+
+	pthread_mutex_lock(&psk_mutex);
+	job = psk_done;
+	psk_done = psk_donelast = NULL;
+	pthread_mutex_unlock(&psk_mutex);
+
+	for (struct pskjob *next; job; job = next) {
+		next = job->next;
+		wif = job->wif;
+		if (job->ok) {
+			struct network *net;
+
+			psk_cache_add(job);
+			/* the network was created with the request */
+			net = find_network_by_ssid(job->ssid);
+			if (net)
+				add_network_config(net, "psk", job->textpsk);
+			else
+				mylog(LOG_INFO, "network '%s' removed before its psk was ready", job->ssid);
+		} else
+			publish_failure("create psk for '%s' failed", job->ssid);
+		/* wipe the passphrase */
+		memset(job->passphrase, 0, strlen(job->passphrase));
+		free(job->passphrase);
+		free(job->ssid);
+		free(job);
+	}
+}
+#endif
+
 /* MQTT API */
 static struct network *find_or_create_ssid(const char *ssid)
 {
@@ -1116,13 +3293,74 @@ static struct network *find_or_create_ssid(const char *ssid)
 	if (!net) {
 		wpa_send("ADD_NETWORK");
 		net = add_network(-1, ssid);
-		net->createseq = ++netcreateseq;
+		/* we create it, so we know its mode */
+		net->netflags |= NF_MODE;
+		net->createseq = ++wif->netcreateseq;
 		sort_networks();
 		net = find_network_by_ssid(ssid);
 	}
 	return net;
 }
 
+/* SCAN with the parameters from payload lines:
+ * freq=MHZ[,MHZ...], ssid=SSID, known, passive
+ */
+#define MAX_SCAN_SSIDS	16
+static void wpa_scan_request(char *payload)
+{
+	char cmd[1024], *line, *saveptr;
+	const char *freqs = NULL, *ssids[MAX_SCAN_SSIDS];
+	int j, len, nssids = 0, passive = 0;
+
+	for (line = strtok_r(payload ?: "", "\r\n", &saveptr); line;
+			line = strtok_r(NULL, "\r\n", &saveptr)) {
+		if (!mystrncmp("freq=", line) && strspn(line+5, "0123456789,") == strlen(line+5))
+			freqs = line+5;
+		else if (!mystrncmp("ssid=", line) && line[5] && nssids < MAX_SCAN_SSIDS)
+			ssids[nssids++] = line+5;
+		else if (!strcmp(line, "known")) {
+			for (j = 0; j < wif->nnetworks && nssids < MAX_SCAN_SSIDS; ++j)
+				if (wif->networks[j].id >= 0 && wif->networks[j].mode == 0)
+					ssids[nssids++] = wif->networks[j].ssid;
+		} else if (!strcmp(line, "passive"))
+			passive = 1;
+		else if (strcmp(line, "active")) {
+			publish_failure("scan: bad parameter '%.30s'", line);
+			return;
+		}
+	}
+	/* verify the room before each append, never send a partial ssid */
+	len = sprintf(cmd, "SCAN");
+	if (freqs && *freqs) {
+		if (len + 6 + strlen(freqs) >= sizeof(cmd))
+			goto toolong;
+		len += sprintf(cmd+len, " freq=%s", freqs);
+	}
+	if (passive) {
+		if (len + 10 >= sizeof(cmd))
+			goto toolong;
+		len += sprintf(cmd+len, " passive=1");
+	}
+	/* wpa_supplicant takes the ssids hex encoded */
+	for (j = 0; j < nssids; ++j) {
+		const char *str;
+
+		if (len + 6 + 2*strlen(ssids[j]) >= sizeof(cmd))
+			goto toolong;
+		len += sprintf(cmd+len, " ssid ");
+		for (str = ssids[j]; *str; ++str)
+			len += sprintf(cmd+len, "%02x", (unsigned char)*str);
+	}
+	if (wpa_send("%s", cmd) < 0)
+		/* dropped, and reported */
+		return;
+	/* only this SCAN being accepted starts scan/done */
+	last_queued->flags |= SF_SCANREQ;
+	return;
+toolong:
+	publish_failure("scan: too many parameters");
+}
+
 static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitto_message *msg)
 {
 	int ret;
@@ -1138,7 +3376,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 		mylog(LOG_ERR, "mosquitto tokenize %s: %s", msg->topic, mosquitto_strerror(ret));
 	if (ntoks >= 4 &&
 			!strcmp(toks[0], "net") &&
-			!strcmp(toks[1], iface) &&
+			(wif = find_wif(toks[1])) != NULL &&
 			!strcmp(toks[2], "ssid")) {
 		struct network *net;
 
@@ -1146,16 +3384,16 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 			/* select new ssid. Do this only for new msgs (!retained) */
 			if (!msg->payloadlen || !strcmp(msg->payload, "none")) {
 				wpa_send("DISABLE_NETWORK all");
-				selectedmode = -1;
+				wif->selectedmode = -1;
 			} else if (!strcmp(msg->payload, "all")) {
 				wpa_send("ENABLE_NETWORK all");
-				selectedmode = -1;
+				wif->selectedmode = -1;
 			} else {
 				struct network *net;
 
 				net = find_network_by_ssid(msg->payload ?: "");
 				if (net && net->id >= 0)
-					wpa_send("SELECT_NETWORK %i", net->id);
+					select_network(net);
 				else if (net)
 					net->netflags |= NF_SEL;
 				else
@@ -1169,7 +3407,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 			else if (net)
 				/* queue flags already */
 				net->flags &= ~BF_DISABLED;
-			selectedmode = -1;
+			wif->selectedmode = -1;
 
 		} else if (!strcmp(toks[3], "disable")) {
 			net = find_network_by_ssid((char *)msg->payload);
@@ -1177,7 +3415,7 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 				wpa_send("DISABLE_NETWORK %i", net->id);
 			else if (net)
 				net->flags |= BF_DISABLED;
-			selectedmode = -1;
+			wif->selectedmode = -1;
 
 		} else if (!strcmp(toks[3], "remove")) {
 			net = find_network_by_ssid((char *)msg->payload);
@@ -1194,28 +3432,23 @@ static void my_mqtt_msg(struct mosquitto *mosq, void *dat, const struct mosquitt
 			char *ssid = strtok((char *)msg->payload, "\n\r=");
 			/* psk is second line */
 			char *psk = strtok(NULL, "\n\r");
+			/* create the network now, so it can be selected,
+			 * even while the psk is being derived
+			 */
+			net = find_or_create_ssid(ssid);
 #ifdef NOPLAINPSK
 			/* test for plaintext PSK, and encrypt if so */
-			if (*psk == '"' && psk[strlen(psk)-1] == '"') {
+			if (ssid && psk && *psk == '"' && psk[strlen(psk)-1] == '"') {
 				/* strip " */
 				psk[strlen(psk)-1] = 0;
 				++psk;
 
-				/* encrypt */
-				static uint8_t binpsk[32];
-				static char textpsk[65];
-				if (!PKCS5_PBKDF2_HMAC_SHA1(psk, strlen(psk), (const void *)ssid, strlen(ssid),
-						4096, sizeof(binpsk), binpsk)) {
-					publish_failure("create psk for '%s' failed", ssid);
+				/* encrypt, psk_collect() finishes uncached keys */
+				psk = (char *)psk_derive(ssid, psk);
+				if (!psk)
 					goto psk_done;
-				}
-				/* convert to text */
-				for (j =0; j < sizeof(binpsk); ++j)
-					sprintf(textpsk[j*2], "%02x", binpsk[j]);
-				psk = textpsk;
 			}
 #endif
-			net = find_or_create_ssid(ssid);
 			add_network_config(net, "psk", psk);
 #ifdef NOPLAINPSK
 /* add an empty statement after the label,
@@ -1268,25 +3501,32 @@ psk_done:;
 		} else if (!strcmp(toks[3], "create")) {
 			find_or_create_ssid((char *)msg->payload);
 		}
+	} else if (ntoks == 4 &&
+			!strcmp(toks[0], "net") &&
+			(wif = find_wif(toks[1])) != NULL &&
+			!strcmp(toks[2], "scan") &&
+			!strcmp(toks[3], "set")) {
+		wpa_scan_request((char *)msg->payload);
+
 	} else if (ntoks == 5 &&
 			!strcmp(toks[0], "net") &&
-			!strcmp(toks[1], iface) &&
+			(wif = find_wif(toks[1])) != NULL &&
 			!strcmp(toks[2], "wifi") &&
 			!strcmp(toks[3], "config")) {
 		wpa_send("SET %s %s", toks[4], (char *)msg->payload);
 
 	} else if (ntoks == 4 &&
 			!strcmp(toks[0], "net") &&
-			!strcmp(toks[1], iface) &&
+			(wif = find_wif(toks[1])) != NULL &&
 			!strcmp(toks[2], "wifistate") &&
 			!strcmp(toks[3], "set")) {
 		if (!strcmp((char *)msg->payload, "off")) {
 			wpa_send("DISABLE_NETWORK all");
-			selectedmode = -1;
+			wif->selectedmode = -1;
 
 		} else if (!strcmp((char *)msg->payload, "any")) {
 			wpa_send("ENABLE_NETWORK all");
-			selectedmode = -1;
+			wif->selectedmode = -1;
 
 		} else {
 			static const char *modes[] = {
@@ -1294,40 +3534,40 @@ psk_done:;
 				[2] = "AP",
 				[5] = "mesh",
 			};
-			selectedmode = -1;
+			wif->selectedmode = -1;
 			int j;
 
 			for (j = 0; j < sizeof(modes)/sizeof(modes[0]); ++j) {
 				if (modes[j] && !strcasecmp(modes[j], (char *)msg->payload)) {
-					selectedmode = j;
+					wif->selectedmode = j;
 					break;
 				}
 			}
 
-			if (selectedmode != j) {
+			if (wif->selectedmode != j) {
 				mylog(LOG_INFO, "selected unknown wifi mode %s", (char *)msg->payload);
 				goto wifimodeset_done;
 			}
 
-			mylog(LOG_INFO, "selected wifi mode %s (%i)", (char *)msg->payload, selectedmode);
+			mylog(LOG_INFO, "selected wifi mode %s (%i)", (char *)msg->payload, wif->selectedmode);
 			/* disable all networks, and enable those of the new mode */
-			for (j = 0; j < nnetworks; ++j) {
-				if (networks[j].id < 0) {
-					if (networks[j].mode == selectedmode)
-						networks[j].flags &= ~BF_DISABLED;
+			for (j = 0; j < wif->nnetworks; ++j) {
+				if (wif->networks[j].id < 0) {
+					if (wif->networks[j].mode == wif->selectedmode)
+						wif->networks[j].flags &= ~BF_DISABLED;
 					else
-						networks[j].flags |= BF_DISABLED;
+						wif->networks[j].flags |= BF_DISABLED;
 
-				} else if (networks[j].mode == selectedmode && networks[j].flags & BF_DISABLED) {
-					wpa_send("ENABLE_NETWORK %i", networks[j].id);
+				} else if (wif->networks[j].mode == wif->selectedmode && wif->networks[j].flags & BF_DISABLED) {
+					wpa_send("ENABLE_NETWORK %i", wif->networks[j].id);
 
-				} else if (networks[j].mode != selectedmode && !(networks[j].flags & BF_DISABLED)) {
-					wpa_send("DISABLE_NETWORK %i", networks[j].id);
+				} else if (wif->networks[j].mode != wif->selectedmode && !(wif->networks[j].flags & BF_DISABLED)) {
+					wpa_send("DISABLE_NETWORK %i", wif->networks[j].id);
 				}
 			}
 			/* clear current SSID, before ack of new wifistate */
-			publish_value("", topicfmt("net/%s/ssid", iface));
-			set_wifi_state(modes[selectedmode]);
+			publish_value("", topicfmt("net/%s/ssid", wif->iface));
+			set_wifi_state(modes[wif->selectedmode]);
 		}
 wifimodeset_done:
 		;
@@ -1339,29 +3579,112 @@ static void publish_value(const char *value, const char *topic)
 {
 	int ret;
 
+	if (!snapshot_update(topic, value))
+		/* broker has it already */
+		return;
 	/* publish cache */
 	ret = mosquitto_publish(mosq, NULL, topic, strlen(value ?: ""), value, mqtt_qos, 1);
 	if (ret)
 		mylog(LOG_ERR, "mosquitto_publish %s: %s", topic, mosquitto_strerror(ret));
 }
 
-static void publish_ivalue_if_different(const char *newvalue, int *saved, const char *topic)
+/* noisy values of the interface */
+static void hyst_timeout(void *dat);
+
+/* arm the timer for the first held value that becomes due */
+static void hyst_schedule(void)
 {
-	int ret;
-	int newivalue;
+	const struct hystval *hv;
+	const struct hyst *hy;
+	double due, next = 0;
+	int j;
+
+	for (j = 0; j < NHYST; ++j) {
+		hv = &wif->hyst[j];
+		hy = &hysts[j];
+		if (!hv->holding)
+			continue;
+		if (abs(hv->held - hv->value) >= hy->deadband)
+			due = hv->t + hy->mininterval;
+		else if (hy->maxstale)
+			due = hv->t + ((hy->maxstale > hy->mininterval) ? hy->maxstale : hy->mininterval);
+		else
+			/* held until a larger change */
+			continue;
+		if (!next || due < next)
+			next = due;
+	}
+	if (next)
+		libt_add_timeout((next > mono_now()) ? next - mono_now() : 0, hyst_timeout, wif);
+	else
+		libt_remove_timeout(hyst_timeout, wif);
+}
+
+static void hyst_timeout(void *dat)
+{
+	struct hystval *hv;
+	int j;
+
+	wif = dat;
+	for (j = 0; j < NHYST; ++j) {
+		hv = &wif->hyst[j];
+		if (hv->holding && hyst_pass(j, hv->value, hv->t, hv->held, mono_now()))
+			set_hyst(j, hv->held);
+	}
+	hyst_schedule();
+}
 
-	newivalue = strtol(newvalue ?: "", NULL, 0);
+/* publish newvalue now, bypassing the hysteresis */
+static void set_hyst(int type, int newvalue)
+{
+	struct hystval *hv = &wif->hyst[type];
+
+	hv->holding = 0;
+	if (!hv->published || hv->value != newvalue)
+		publish_value(valuetostr("%i", newvalue),
+				topicfmt("net/%s/%s", wif->iface, hystnames[type]));
+	hv->value = newvalue;
+	hv->published = 1;
+	hv->t = mono_now();
+}
+
+/* publish newvalue when the hysteresis allows,
+ * or hold it until it is due
+ */
+static void publish_hyst(int type, int newvalue)
+{
+	struct hystval *hv = &wif->hyst[type];
 
-	if (newivalue == *saved)
+	if (hv->published && newvalue == hv->value) {
+		hv->holding = 0;
+		return;
+	}
+	if (hv->published && !hyst_pass(type, hv->value, hv->t, newvalue, mono_now())) {
+		hv->held = newvalue;
+		hv->holding = 1;
+		hyst_schedule();
 		return;
+	}
+	set_hyst(type, newvalue);
+}
 
-	newvalue = valuetostr("%i", newivalue);
-	/* publish cache */
-	ret = mosquitto_publish(mosq, NULL, topic, strlen(newvalue ?: ""), newvalue, mqtt_qos, 1);
-	if (ret)
-		mylog(LOG_ERR, "mosquitto_publish %s: %s", topic, mosquitto_strerror(ret));
+static void clear_hyst(int type)
+{
+	struct hystval *hv = &wif->hyst[type];
+
+	if (hv->published)
+		publish_value("", topicfmt("net/%s/%s", wif->iface, hystnames[type]));
+	memset(hv, 0, sizeof(*hv));
+}
 
-	*saved = newivalue;
+static void publish_svalue_if_different(const char *newvalue, char **saved, const char *topic)
+{
+	newvalue = newvalue ?: "";
+	if (*saved && !strcmp(*saved, newvalue))
+		return;
+	myfree(*saved);
+	*saved = strdup(newvalue);
+	publish_value(newvalue, topic);
 }
 
 static void publish_failure(const char *valuefmt, ...)
@@ -1371,7 +3694,7 @@ static void publish_failure(const char *valuefmt, ...)
 	static char topic[1024];
 	static char value[1024];
 
-	sprintf(topic, "net/%s/fail", iface);
+	sprintf(topic, "net/%s/fail", wif->iface);
 
 	va_start(va, valuefmt);
 	vsprintf(value, valuefmt, va);
@@ -1383,6 +3706,18 @@ static void publish_failure(const char *valuefmt, ...)
 		mylog(LOG_ERR, "mosquitto_publish %s: %s", topic, mosquitto_strerror(ret));
 }
 
+/* diagnostics, not retained */
+static void publish_diag(const char *name, const char *value)
+{
+	int ret;
+	static char topic[1024];
+
+	sprintf(topic, "net/%s/diag/%s", wif->iface, name);
+	ret = mosquitto_publish(mosq, NULL, topic, strlen(value), value, mqtt_qos, 0);
+	if (ret)
+		mylog(LOG_ERR, "mosquitto_publish %s: %s", topic, mosquitto_strerror(ret));
+}
+
 static const char *valuetostr(const char *fmt, ...)
 {
 	va_list va;
@@ -1432,7 +3767,8 @@ int main(int argc, char *argv[])
 	int opt, ret, j;
 	char *str;
 	char mqtt_name[32];
-	struct pollfd pf[3];
+	struct pollfd *pf;
+	int npf;
 
 	setlocale(LC_ALL, "");
 	/* argument parsing */
@@ -1455,11 +3791,61 @@ int main(int argc, char *argv[])
 		}
 		break;
 	case 'i':
-		iface = optarg;
+		/* multiple interfaces, in 1 process */
+		for (str = strtok(optarg, ","); str; str = strtok(NULL, ","))
+			if (!find_wif(str))
+				add_wif(str);
 		break;
 	case 'S':
 		noapbgscan = 1;
 		break;
+	case 'b':
+		bulkbss = 1;
+		break;
+	case 'c':
+		compactbss = 1;
+		break;
+	case 't':
+		bsstable = 1;
+		break;
+	case 'n':
+		bsstop = strtoul(optarg, NULL, 0);
+		bssranked = 1;
+		break;
+	case 'L':
+		bssminlevel = strtol(optarg, NULL, 0);
+		bssranked = 1;
+		break;
+	case 'w':
+		save_delay = strtod(optarg, NULL);
+		break;
+	case 'm':
+		sigmon = 1;
+		sigmon_threshold = strtol(optarg, &str, 0);
+		if (*str == ',')
+			sigmon_hysteresis = strtoul(str+1, NULL, 0);
+		/* rssi arrives via events, keepalive is only a PING */
+		keepalive_delay = 60;
+		break;
+	case 's':
+		statefile = optarg;
+		break;
+	case 'p':
+		sta_poll_delay = strtod(optarg, NULL);
+		break;
+	case 'C':
+		ctrl_dir = optarg;
+		break;
+	case 'D':
+		diag_delay = strtod(optarg, NULL);
+		break;
+	case 'H':
+		if (parse_hysteresis(optarg) < 0) {
+			fprintf(stderr, "%s: bad hysteresis '%s'\n", NAME, optarg);
+			fputs(help_msg, stderr);
+			exit(1);
+		}
+		break;
 
 	default:
 		fprintf(stderr, "unknown option '%c'", opt);
@@ -1469,11 +3855,21 @@ int main(int argc, char *argv[])
 		break;
 	}
 
+	if (!nwifs)
+		add_wif("wlan0");
+
 	setmylog(NAME, 0, LOG_LOCAL2, loglevel);
 
+	if (statefile) {
+		snapshot_load(statefile);
+		libt_add_timeout(SNAPSHOT_PERIOD, save_state, NULL);
+	}
 	/* WPA */
-	wpasock = wpa_connect(iface);
-	wpa_send("ATTACH");
+	wpa_init_dispatch();
+	for (wif = wifs; wif < wifs+nwifs; ++wif) {
+		wif->wpasock = wpa_connect(1);
+		wpa_send("ATTACH");
+	}
 	/* MQTT start */
 	if (mqtt_qos < 0)
 		mqtt_qos = !strcmp(mqtt_host ?: "", "localhost") ? 0 : 1;
@@ -1488,10 +3884,16 @@ int main(int argc, char *argv[])
 	if (ret)
 		mylog(LOG_ERR, "mosquitto_connect %s:%i: %s", mqtt_host, mqtt_port, mosquitto_strerror(ret));
 	mosquitto_message_callback_set(mosq, my_mqtt_msg);
-	subscribe_topic(topicfmt("net/%s/ssid/+", iface));
-	subscribe_topic(topicfmt("net/%s/wifistate/set", iface));
-
 	libt_add_timeout(0, do_mqtt_maintenance, mosq);
+	for (wif = wifs; wif < wifs+nwifs; ++wif) {
+		subscribe_topic(topicfmt("net/%s/ssid/+", wif->iface));
+		subscribe_topic(topicfmt("net/%s/wifistate/set", wif->iface));
+		subscribe_topic(topicfmt("net/%s/scan/set", wif->iface));
+		if (sta_poll_delay)
+			libt_add_timeout(sta_poll_delay, sta_poll, wif);
+		if (diag_delay)
+			libt_add_timeout(diag_delay, publish_cmd_timing, wif);
+	}
 
 	/* prepare signalfd */
 	struct signalfd_siginfo sfdi;
@@ -1506,42 +3908,57 @@ int main(int argc, char *argv[])
 	sigfd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
 	if (sigfd < 0)
 		mylog(LOG_ERR, "signalfd failed: %s", ESTR(errno));
-	/* prepare poll */
-	pf[0].fd = wpasock;
+	/* prepare poll, the interfaces follow the fixed fds */
+#define PF_WIF	3
+	pf = calloc(PF_WIF+nwifs, sizeof(*pf));
+	if (!pf)
+		mylog(LOG_ERR, "calloc %i pollfds: %s", PF_WIF+nwifs, ESTR(errno));
+	pf[0].fd = mosquitto_socket(mosq);
 	pf[0].events = POLL_IN;
-	pf[1].fd = mosquitto_socket(mosq);
+	pf[1].fd = sigfd;
 	pf[1].events = POLL_IN;
-	pf[2].fd = sigfd;
+	/* poll ignores -1 */
+	pf[2].fd = -1;
+#ifdef NOPLAINPSK
+	psk_init();
+	pf[2].fd = pskfd;
 	pf[2].events = POLL_IN;
+#endif
+	for (j = 0; j < nwifs; ++j)
+		pf[PF_WIF+j].events = POLL_IN;
+	npf = PF_WIF+nwifs;
 
 	for (;;) {
 		libt_flush();
-		if (wpa_lost)
-			break;
+		/* wpasock changes while reconnecting, poll ignores -1 */
+		for (j = 0; j < nwifs; ++j)
+			pf[PF_WIF+j].fd = wifs[j].wpasock;
 		if (mosquitto_want_write(mosq)) {
 			ret = mosquitto_loop_write(mosq, 1);
 			if (ret)
 				mylog(LOG_WARNING, "mosquitto_loop_write: %s", mosquitto_strerror(ret));
 		}
-		ret = poll(pf, 3, libt_get_waittime());
+		ret = poll(pf, npf, libt_get_waittime());
 		if (ret < 0 && errno == EINTR)
 			continue;
 		if (ret < 0)
 			mylog(LOG_ERR, "poll ...");
-		if (pf[0].revents) {
-			static char line[1024*16];
+		for (j = 0; j < nwifs; ++j) {
+			if (!pf[PF_WIF+j].revents)
+				continue;
+			wif = wifs+j;
 			/* read input events */
-			ret = recv(wpasock, line, sizeof(line)-1, 0);
+			ret = wpa_recv();
 			if (ret < 0 && errno == EINTR)
 				continue;
 			if (ret < 0) {
-				mylog(LOG_WARNING, "recv wpa: %s", ESTR(errno));
-				break;
+				mylog(LOG_WARNING, "recv wpa %s: %s", wif->iface, ESTR(errno));
+				wpa_cmd_timeout(wif);
+				continue;
 			}
-			line[ret] = 0;
-			wpa_recvd_pkt(line);
+			wpa_recvd_pkt(rxbuf);
 		}
-		if (pf[1].revents) {
+		if (pf[0].revents) {
 			/* mqtt read ... */
 			ret = mosquitto_loop_read(mosq, 1);
 			if (ret) {
@@ -1552,7 +3969,7 @@ int main(int argc, char *argv[])
 				break;
 			}
 		}
-		while (pf[2].revents) {
+		while (pf[1].revents) {
 			ret = read(sigfd, &sfdi, sizeof(sfdi));
 			if (ret < 0 && errno == EAGAIN)
 				break;
@@ -1565,28 +3982,41 @@ int main(int argc, char *argv[])
 				break;
 			}
 		}
+#ifdef NOPLAINPSK
+		if (pf[2].revents)
+			psk_collect();
+#endif
 	}
 done:
+	free(pf);
+	if (statefile) {
+		/* leave the state in the broker */
+		snapshot_save();
+		goto terminate;
+	}
 
-	/* clean scan results in mqtt */
-	for (j = 0; j < nbsss; ++j) {
-		publish_value("", topicfmt("net/%s/bss/%s/freq", iface, bsss[j].bssid));
-		publish_value("", topicfmt("net/%s/bss/%s/level", iface, bsss[j].bssid));
-		publish_value("", topicfmt("net/%s/bss/%s/ssid", iface, bsss[j].bssid));
-		publish_value("", topicfmt("net/%s/bss/%s/flags", iface, bsss[j].bssid));
-	}
-	publish_value("", topicfmt("net/%s/speed", iface));
-	publish_value("", topicfmt("net/%s/rssi", iface));
-	publish_value("", topicfmt("net/%s/bssid", iface));
-	publish_value("", topicfmt("net/%s/freq", iface));
-	publish_value("", topicfmt("net/%s/level", iface));
-	publish_value("", topicfmt("net/%s/ssid", iface));
-	publish_value("", topicfmt("net/%s/lastAP", iface));
-	publish_value("", topicfmt("net/%s/lastmesh", iface));
-	publish_value("", topicfmt("net/%s/stations", iface));
-	publish_value("", topicfmt("net/%s/wifistate", iface));
-
-	/* terminate */
+	for (wif = wifs; wif < wifs+nwifs; ++wif) {
+		/* clean scan results in mqtt */
+		for (j = 0; j < wif->nbsss; ++j)
+			unpublish_bss(wif->bsss+j);
+		if (bsstable) {
+			libt_remove_timeout(publish_bsstable, wif);
+			publish_value("", topicfmt("net/%s/bsstable", wif->iface));
+		}
+		publish_value("", topicfmt("net/%s/speed", wif->iface));
+		publish_value("", topicfmt("net/%s/rssi", wif->iface));
+		publish_value("", topicfmt("net/%s/bssid", wif->iface));
+		publish_value("", topicfmt("net/%s/freq", wif->iface));
+		publish_value("", topicfmt("net/%s/level", wif->iface));
+		publish_value("", topicfmt("net/%s/ssid", wif->iface));
+		publish_value("", topicfmt("net/%s/lastAP", wif->iface));
+		publish_value("", topicfmt("net/%s/lastmesh", wif->iface));
+		flush_stas();
+		publish_value("", topicfmt("net/%s/stations", wif->iface));
+		publish_value("", topicfmt("net/%s/wifistate", wif->iface));
+	}
+
+terminate:
 	send_self_sync(mosq, mqtt_qos);
 	while (!ready) {
 		ret = mosquitto_loop(mosq, 10, 1);
@@ -1594,24 +4024,38 @@ done:
 			mylog(LOG_ERR, "mosquitto_loop: %s", mosquitto_strerror(ret));
 	}
 
-#if 0
 	/* free memory */
-	for (j = 0; j < nbsss; ++j)
-		myfree(bsss[j].ssid);
-	myfree(bsss);
-	for (j = 0; j < nnetworks; ++j) {
-		myfree(networks[j].ssid);
-		remove_network_configs(&networks[j]);
+	for (wif = wifs; wif < wifs+nwifs; ++wif) {
+		/* ssids are interned, release the references */
+		for (j = 0; j < wif->nbsss; ++j)
+			put_ssid(wif->bsss[j].ssidid);
+		myfree(wif->bsss);
+		myfree(wif->bssshown.idx);
+		myfree(wif->bsshidden.idx);
+		hidx_free(&wif->bssidx);
+		for (j = 0; j < wif->nnetworks; ++j) {
+			put_ssid(wif->networks[j].ssidid);
+			remove_network_configs(&wif->networks[j]);
+		}
+		myfree(wif->networks);
+		myfree(wif->ssids);
+		hidx_free(&wif->ssididx);
+		myfree(wif->saved_bssid);
+		myfree(wif->saved_freq);
+		myfree(wif->saved_ssid);
+		myfree(wif->stas);
+		hidx_free(&wif->staidx);
+		myfree(wif->unnamed);
+
+		struct str *head;
+		for (head = pop_strq(); head; head = pop_strq())
+			put_str(head);
+		flush_lanes();
 	}
-	myfree(networks);
-
-	struct str *head;
-	for (head = pop_strq(); head; head = pop_strq())
-		free(head);
+	myfree(wifs);
 
 	mosquitto_disconnect(mosq);
 	mosquitto_destroy(mosq);
 	mosquitto_lib_cleanup();
-#endif
 	return !sigterm;
 }
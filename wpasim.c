@@ -0,0 +1,1122 @@
+/*
+ * Copyright 2018 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "libet/libt.h"
+#include "common.h"
+
+#define NAME "wpasim"
+#ifndef VERSION
+#define VERSION "<undefined version>"
+#endif
+
+#define ESTR(num)	strerror(num)
+
+/* program options */
+static const char help_msg[] =
+	NAME ": simulate a wpa_supplicant control socket\n"
+	"usage:	" NAME " [OPTIONS ...] [SCRIPT]\n"
+	"\n"
+	"Options\n"
+	" -V, --version		Show version\n"
+	" -v, --verbose		Be more verbose\n"
+	"\n"
+	" -C, --ctrl-dir=DIR	Create the socket in DIR (default /var/run/wpa_supplicant)\n"
+	" -i, --iface=IFACE	Simulate IFACE (default: wlan0)\n"
+	" -n, --bss=NUM		Start with NUM random BSS's (default 20)\n"
+	" -s, --seed=NUM		Seed the random world (default 1)\n"
+	" -R, --random=RATE	Change the random world RATE times per second\n"
+	" -a, --ap=NUM		Operate as accesspoint with NUM stations\n"
+	" -q, --queue=NUM	Drop datagrams beyond NUM queued (default 1024)\n"
+	"\n"
+	"Arguments\n"
+	" SCRIPT	Read commands from SCRIPT, - for stdin\n"
+	"\n"
+	"Script commands\n"
+	" sleep SECS		Delay the next command\n"
+	" add SSID [FREQ [LEVEL]]	Add a BSS\n"
+	" del BSSID		Remove a BSS\n"
+	" clear			Remove all BSS's\n"
+	" level BSSID DBM	Change the level of a BSS\n"
+	" connect BSSID		Associate with BSSID\n"
+	" disconnect		Disassociate\n"
+	" scan			Emit scan results\n"
+	" storm NUM RATE		Add NUM BSS's, at RATE per second.\n"
+	"			Their SSID is t<NSEC>, the realtime of creation\n"
+	" sta-add MAC		Connect a station to the accesspoint\n"
+	" sta-del MAC		Disconnect a station\n"
+	" event TEXT		Emit event TEXT\n"
+	" stats			Print statistics on stdout\n"
+	" quit			Terminate\n"
+	;
+
+#ifdef _GNU_SOURCE
+static struct option long_opts[] = {
+	{ "help", no_argument, NULL, '?', },
+	{ "version", no_argument, NULL, 'V', },
+	{ "verbose", no_argument, NULL, 'v', },
+
+	{ "ctrl-dir", required_argument, NULL, 'C', },
+	{ "iface", required_argument, NULL, 'i', },
+	{ "bss", required_argument, NULL, 'n', },
+	{ "seed", required_argument, NULL, 's', },
+	{ "random", required_argument, NULL, 'R', },
+	{ "ap", required_argument, NULL, 'a', },
+	{ "queue", required_argument, NULL, 'q', },
+	{ },
+};
+#else
+#define getopt_long(argc, argv, optstring, longopts, longindex) \
+	getopt((argc), (argv), (optstring))
+#endif
+static const char optstring[] = "Vv?C:i:n:s:R:a:q:";
+
+/* signal handler */
+static volatile int sigterm;
+
+/* logging */
+static int loglevel = LOG_WARNING;
+
+/* program parameters */
+static const char *ctrldir = "/var/run/wpa_supplicant";
+static const char *iface = "wlan0";
+static int nrandom = 20;
+static double random_rate;
+static int maxqueue = 1024;
+
+/* statistics */
+static unsigned long ncmds, nreplies, nevents, ndropped;
+
+static int mysignal(int signr, void (*fn)(int))
+{
+	struct sigaction sa = {
+		.sa_handler = fn,
+	};
+	return sigaction(signr, &sa, NULL);
+}
+static void onsigterm(int signr)
+{
+	sigterm = 1;
+}
+
+/* world model: BSS's, ordered on id */
+struct bss {
+	int id;
+	char bssid[18];
+	int freq;
+	int level;
+	int removed;
+	char *ssid;
+	const char *flags;
+};
+
+static struct bss *bsss;
+static int nbsss, sbsss, nremoved;
+static struct hidx bssidx;
+static int nextbssid;
+static unsigned int nextmac;
+
+static int bssmatch(int idx, const void *key)
+{
+	return !strcmp(bsss[idx].bssid, key);
+}
+
+static struct bss *find_bss(const char *bssid)
+{
+	int idx;
+
+	idx = hidx_find(&bssidx, strhash(bssid), bssmatch, bssid);
+	return (idx < 0) ? NULL : bsss+idx;
+}
+
+static struct bss *find_bss_id(int id)
+{
+	int lo = 0, hi = nbsss, mid;
+
+	/* ids are ascending */
+	while (lo < hi) {
+		mid = (lo+hi)/2;
+		if (bsss[mid].id < id)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return (lo < nbsss && bsss[lo].id == id && !bsss[lo].removed) ? bsss+lo : NULL;
+}
+
+static void compact_bsss(void)
+{
+	int j, k;
+
+	hidx_free(&bssidx);
+	for (j = k = 0; j < nbsss; ++j) {
+		if (bsss[j].removed)
+			continue;
+		bsss[k] = bsss[j];
+		hidx_add(&bssidx, strhash(bsss[k].bssid), k);
+		++k;
+	}
+	nbsss = k;
+	nremoved = 0;
+}
+
+static struct bss *add_bss(const char *ssid, int freq, int level, const char *flags)
+{
+	struct bss *bss;
+
+	if (nbsss+1 > sbsss) {
+		sbsss += 16;
+		bsss = realloc(bsss, sizeof(*bsss)*sbsss);
+		if (!bsss)
+			mylog(LOG_ERR, "realloc %i bsss: %s", sbsss, ESTR(errno));
+	}
+	bss = &bsss[nbsss];
+	memset(bss, 0, sizeof(*bss));
+	bss->id = nextbssid++;
+	sprintf(bss->bssid, "02:5e:%02x:%02x:%02x:%02x",
+			(nextmac >> 24) & 0xff, (nextmac >> 16) & 0xff,
+			(nextmac >> 8) & 0xff, nextmac & 0xff);
+	++nextmac;
+	bss->ssid = strdup(ssid);
+	bss->freq = freq;
+	bss->level = level;
+	bss->flags = flags;
+	hidx_add(&bssidx, strhash(bss->bssid), nbsss);
+	++nbsss;
+	return bss;
+}
+
+static void remove_bss(struct bss *bss)
+{
+	hidx_remove(&bssidx, strhash(bss->bssid), bss - bsss);
+	myfree(bss->ssid);
+	bss->ssid = NULL;
+	bss->removed = 1;
+	++nremoved;
+	/* trailing tombstones need no compaction */
+	for (; nbsss && bsss[nbsss-1].removed; --nbsss)
+		--nremoved;
+	if (nremoved > nbsss/2)
+		compact_bsss();
+}
+
+static const int freqs[] = { 2412, 2437, 2462, 5180, 5240, 5500, };
+static const char *const bssflags[] = {
+	"[WPA2-PSK-CCMP][ESS]",
+	"[WPA-PSK-TKIP][WPA2-PSK-CCMP][ESS]",
+	"[WPA2-EAP-CCMP][ESS]",
+	"[ESS]",
+};
+
+static struct bss *add_random_bss(void)
+{
+	char ssid[16];
+
+	sprintf(ssid, "net%i", rand() % 64);
+	return add_bss(ssid, freqs[rand() % (sizeof(freqs)/sizeof(freqs[0]))],
+			-30 - rand() % 60,
+			bssflags[rand() % (sizeof(bssflags)/sizeof(bssflags[0]))]);
+}
+
+/* configured networks */
+struct network {
+	int id;
+	char *ssid;
+	int disabled;
+	int mode;
+};
+
+static struct network *networks;
+static int nnetworks, snetworks;
+static int nextnetid;
+
+static struct network *find_network(int id)
+{
+	int j;
+
+	for (j = 0; j < nnetworks; ++j)
+		if (networks[j].id == id)
+			return networks+j;
+	return NULL;
+}
+
+static struct network *add_network(const char *ssid)
+{
+	struct network *net;
+
+	if (nnetworks+1 > snetworks) {
+		snetworks += 16;
+		networks = realloc(networks, sizeof(*networks)*snetworks);
+		if (!networks)
+			mylog(LOG_ERR, "realloc %i networks: %s", snetworks, ESTR(errno));
+	}
+	net = &networks[nnetworks++];
+	memset(net, 0, sizeof(*net));
+	net->id = nextnetid++;
+	net->ssid = strdup(ssid);
+	net->disabled = 1;
+	return net;
+}
+
+static void remove_network(struct network *net)
+{
+	int idx = net - networks;
+
+	myfree(net->ssid);
+	if (idx != nnetworks-1)
+		memmove(net, net+1, (nnetworks-1-idx)*sizeof(*networks));
+	--nnetworks;
+}
+
+/* accesspoint stations */
+struct sta {
+	char mac[18];
+	time_t since;
+	unsigned long rxbytes, txbytes;
+	int signal;
+};
+
+static struct sta *stas;
+static int nstas, sstas;
+
+static int find_sta(const char *mac)
+{
+	int j;
+
+	for (j = 0; j < nstas; ++j)
+		if (!strcasecmp(stas[j].mac, mac))
+			return j;
+	return -1;
+}
+
+static void add_sta(const char *mac)
+{
+	if (find_sta(mac) >= 0)
+		return;
+	if (nstas+1 > sstas) {
+		sstas += 16;
+		stas = realloc(stas, sizeof(*stas)*sstas);
+		if (!stas)
+			mylog(LOG_ERR, "realloc %i stas: %s", sstas, ESTR(errno));
+	}
+	strncpy(stas[nstas].mac, mac, sizeof(stas[nstas].mac)-1);
+	stas[nstas].mac[sizeof(stas[nstas].mac)-1] = 0;
+	stas[nstas].since = time(NULL) - rand() % 3600;
+	stas[nstas].rxbytes = stas[nstas].txbytes = 0;
+	stas[nstas].signal = -40 - rand() % 40;
+	++nstas;
+}
+
+static void remove_sta(int idx)
+{
+	if (idx != nstas-1)
+		memmove(stas+idx, stas+idx+1, (nstas-1-idx)*sizeof(*stas));
+	--nstas;
+}
+
+/* connection state */
+static int apmode;
+/* bss pointers do not survive realloc nor compaction, remember the id */
+static int curr_id = -1;
+#define curr	find_bss_id(curr_id)
+static int sigmon, sigmon_threshold, sigmon_hysteresis;
+static int sigmon_level;
+
+/* control socket */
+static int sock;
+
+struct pkt {
+	struct pkt *next;
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	int len;
+	char dat[1];
+};
+
+static struct pkt *outq, *outqlast;
+static int noutq;
+
+/* attached monitors */
+static struct sockaddr_un *mons;
+static socklen_t *monlens;
+static int nmons, smons;
+
+static void flush_outq(void)
+{
+	struct pkt *pkt;
+	int ret;
+
+	while (outq) {
+		pkt = outq;
+		ret = sendto(sock, pkt->dat, pkt->len, MSG_DONTWAIT,
+				(struct sockaddr *)&pkt->addr, pkt->addrlen);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (ret < 0)
+			mylog(LOG_INFO, "sendto %s: %s", pkt->addr.sun_path+1, ESTR(errno));
+		outq = pkt->next;
+		if (!outq)
+			outqlast = NULL;
+		--noutq;
+		free(pkt);
+	}
+}
+
+static void queue_pkt(const struct sockaddr_un *addr, socklen_t addrlen, const char *dat, int len)
+{
+	struct pkt *pkt;
+
+	if (noutq >= maxqueue) {
+		/* wpa_supplicant drops too */
+		++ndropped;
+		return;
+	}
+	pkt = malloc(sizeof(*pkt)+len);
+	if (!pkt)
+		mylog(LOG_ERR, "malloc pkt: %s", ESTR(errno));
+	memcpy(&pkt->addr, addr, addrlen);
+	pkt->addrlen = addrlen;
+	pkt->len = len;
+	memcpy(pkt->dat, dat, len);
+	pkt->next = NULL;
+	if (outqlast)
+		outqlast->next = pkt;
+	else
+		outq = pkt;
+	outqlast = pkt;
+	++noutq;
+	flush_outq();
+}
+
+__attribute__((format(printf,1,2)))
+static void emit_event(const char *fmt, ...)
+{
+	va_list va;
+	char buf[1024];
+	int len, j;
+
+	strcpy(buf, "<3>");
+	va_start(va, fmt);
+	len = 3 + vsnprintf(buf+3, sizeof(buf)-3, fmt, va);
+	va_end(va);
+	if (len >= sizeof(buf))
+		len = sizeof(buf)-1;
+	mylog(LOG_DEBUG, "! %s", buf+3);
+	for (j = 0; j < nmons; ++j) {
+		queue_pkt(mons+j, monlens[j], buf, len);
+		++nevents;
+	}
+}
+
+static void add_mon(const struct sockaddr_un *addr, socklen_t addrlen)
+{
+	int j;
+
+	for (j = 0; j < nmons; ++j)
+		if (monlens[j] == addrlen && !memcmp(mons+j, addr, addrlen))
+			return;
+	if (nmons+1 > smons) {
+		smons += 16;
+		mons = realloc(mons, sizeof(*mons)*smons);
+		monlens = realloc(monlens, sizeof(*monlens)*smons);
+		if (!mons || !monlens)
+			mylog(LOG_ERR, "realloc %i monitors: %s", smons, ESTR(errno));
+	}
+	memcpy(mons+nmons, addr, addrlen);
+	monlens[nmons++] = addrlen;
+}
+
+static void remove_mon(const struct sockaddr_un *addr, socklen_t addrlen)
+{
+	int j;
+
+	for (j = 0; j < nmons; ++j) {
+		if (monlens[j] == addrlen && !memcmp(mons+j, addr, addrlen)) {
+			mons[j] = mons[nmons-1];
+			monlens[j] = monlens[nmons-1];
+			--nmons;
+			return;
+		}
+	}
+}
+
+/* world changes */
+static void bss_added(struct bss *bss)
+{
+	emit_event("CTRL-EVENT-BSS-ADDED %i %s", bss->id, bss->bssid);
+}
+
+static void bss_removed(struct bss *bss)
+{
+	emit_event("CTRL-EVENT-BSS-REMOVED %i %s", bss->id, bss->bssid);
+	if (bss->id == curr_id) {
+		emit_event("CTRL-EVENT-DISCONNECTED bssid=%s reason=4", bss->bssid);
+		curr_id = -1;
+	}
+	remove_bss(bss);
+}
+
+static void bss_level(struct bss *bss, int level)
+{
+	bss->level = level;
+	if (bss->id != curr_id || !sigmon)
+		return;
+	if (abs(level - sigmon_level) < sigmon_hysteresis)
+		return;
+	sigmon_level = level;
+	emit_event("CTRL-EVENT-SIGNAL-CHANGE above=%i signal=%i noise=9999 txrate=65000",
+			level > sigmon_threshold, level);
+}
+
+static void random_change(void *dat)
+{
+	static double t0;
+	static long done;
+	struct bss *bss;
+	int r;
+	double now = mono_now();
+
+	if (!t0)
+		t0 = now;
+	for (; done < (now - t0)*random_rate; ++done) {
+		r = rand() % 10;
+		bss = (nbsss - nremoved) ? find_bss_id(bsss[rand() % nbsss].id) : NULL;
+		if (r == 0 && nbsss - nremoved < nrandom*2)
+			bss_added(add_random_bss());
+		else if (r == 1 && bss && nbsss - nremoved > nrandom/2)
+			bss_removed(bss);
+		else if (bss)
+			bss_level(bss, bss->level + rand() % 11 - 5);
+	}
+	libt_add_timeout(0.01, random_change, dat);
+}
+
+/* control socket replies */
+static char *reply;
+static int sreply, nreply;
+
+__attribute__((format(printf,1,2)))
+static int reply_printf(const char *fmt, ...)
+{
+	va_list va;
+	int len;
+
+	for (;;) {
+		va_start(va, fmt);
+		len = vsnprintf(reply+nreply, sreply-nreply, fmt, va);
+		va_end(va);
+		if (nreply+len < sreply)
+			break;
+		sreply = (nreply+len+1+4095) & ~4095;
+		reply = realloc(reply, sreply);
+		if (!reply)
+			mylog(LOG_ERR, "realloc %i: %s", sreply, ESTR(errno));
+	}
+	nreply += len;
+	return len;
+}
+
+/* BSS field masks, like wpa_supplicant */
+#define BM_ID		(1 << 0)
+#define BM_BSSID	(1 << 1)
+#define BM_FREQ		(1 << 2)
+#define BM_LEVEL	(1 << 7)
+#define BM_FLAGS	(1 << 11)
+#define BM_SSID		(1 << 12)
+#define BM_DELIM	(1 << 17)
+#define BM_ALL		(~BM_DELIM)
+
+static void reply_bss(const struct bss *bss, unsigned int mask)
+{
+	if (mask & BM_ID)
+		reply_printf("id=%i\n", bss->id);
+	if (mask & BM_BSSID)
+		reply_printf("bssid=%s\n", bss->bssid);
+	if (mask & BM_FREQ)
+		reply_printf("freq=%i\n", bss->freq);
+	if (mask & BM_LEVEL)
+		reply_printf("level=%i\n", bss->level);
+	if (mask & BM_FLAGS)
+		reply_printf("flags=%s\n", bss->flags);
+	if (mask & BM_SSID)
+		reply_printf("ssid=%s\n", bss->ssid);
+	if (mask & BM_DELIM)
+		reply_printf("====\n");
+}
+
+/* wpa_supplicant's reply buffer */
+#define REPLY_SIZE	4096
+
+static void handle_bss(char *args)
+{
+	char *range, *tok;
+	unsigned int mask = BM_ALL;
+	int lo, hi, j, saved;
+	struct bss *bss;
+
+	range = strtok(args, " ");
+	for (tok = strtok(NULL, " "); tok; tok = strtok(NULL, " "))
+		if (!strncmp(tok, "MASK=", 5))
+			mask = strtoul(tok+5, NULL, 0);
+
+	if (!range) {
+		reply_printf("FAIL\n");
+		return;
+	}
+	if (!strncmp(range, "RANGE=", 6)) {
+		range += 6;
+		if (!strcmp(range, "ALL")) {
+			lo = 0;
+			hi = nextbssid;
+		} else {
+			lo = strtoul(range, &tok, 0);
+			hi = (*tok == '-' && tok[1]) ? strtoul(tok+1, NULL, 0) : nextbssid;
+		}
+		for (j = 0; j < nbsss; ++j) {
+			bss = bsss+j;
+			if (bss->removed || bss->id < lo || bss->id > hi)
+				continue;
+			saved = nreply;
+			reply_bss(bss, mask);
+			if (nreply > REPLY_SIZE) {
+				/* does not fit anymore */
+				nreply = saved;
+				break;
+			}
+		}
+		return;
+	}
+	bss = strchr(range, ':') ? find_bss(range) : find_bss_id(strtoul(range, NULL, 0));
+	if (bss)
+		reply_bss(bss, mask);
+}
+
+static void handle_cmd(char *cmd, const struct sockaddr_un *addr, socklen_t addrlen)
+{
+	char *tok, *args;
+	struct network *net;
+	struct bss *bss;
+	int j, id;
+
+	++ncmds;
+	mylog(LOG_DEBUG, "< %s", cmd);
+	nreply = 0;
+	reply_printf("%s", "");
+	args = strchr(cmd, ' ');
+	if (args)
+		*args++ = 0;
+
+	if (!strcmp(cmd, "PING")) {
+		reply_printf("PONG\n");
+	} else if (!strcmp(cmd, "ATTACH")) {
+		add_mon(addr, addrlen);
+		reply_printf("OK\n");
+	} else if (!strcmp(cmd, "DETACH")) {
+		remove_mon(addr, addrlen);
+		reply_printf("OK\n");
+	} else if (!strcmp(cmd, "STATUS")) {
+		bss = curr;
+		if (apmode)
+			reply_printf("bssid=02:5e:ff:ff:ff:ff\nfreq=2412\nssid=%s-ap\n"
+					"id=0\nmode=AP\nwpa_state=COMPLETED\n", iface);
+		else if (bss)
+			reply_printf("bssid=%s\nfreq=%i\nssid=%s\nid=0\n"
+					"mode=station\nwpa_state=COMPLETED\n",
+					bss->bssid, bss->freq, bss->ssid);
+		else
+			reply_printf("wpa_state=SCANNING\n");
+	} else if (!strcmp(cmd, "SIGNAL_POLL")) {
+		bss = curr;
+		if (bss)
+			reply_printf("RSSI=%i\nLINKSPEED=65\nNOISE=9999\nFREQUENCY=%i\n",
+					bss->level, bss->freq);
+		else
+			reply_printf("FAIL\n");
+	} else if (!strcmp(cmd, "SIGNAL_MONITOR")) {
+		sigmon = 0;
+		sigmon_hysteresis = 1;
+		for (tok = strtok(args, " "); tok; tok = strtok(NULL, " ")) {
+			if (!strncmp(tok, "THRESHOLD=", 10)) {
+				sigmon_threshold = strtol(tok+10, NULL, 0);
+				sigmon = 1;
+			} else if (!strncmp(tok, "HYSTERESIS=", 11))
+				sigmon_hysteresis = strtoul(tok+11, NULL, 0);
+		}
+		bss = curr;
+		sigmon_level = bss ? bss->level : 0;
+		reply_printf("OK\n");
+	} else if (!strcmp(cmd, "SCAN")) {
+		reply_printf("OK\n");
+		emit_event("CTRL-EVENT-SCAN-STARTED ");
+		emit_event("CTRL-EVENT-SCAN-RESULTS ");
+	} else if (!strcmp(cmd, "SCAN_RESULTS")) {
+		reply_printf("bssid / frequency / signal level / flags / ssid\n");
+		for (j = 0; j < nbsss; ++j) {
+			bss = bsss+j;
+			if (bss->removed)
+				continue;
+			reply_printf("%s\t%i\t%i\t%s\t%s\n", bss->bssid, bss->freq,
+					bss->level, bss->flags, bss->ssid);
+			if (nreply > REPLY_SIZE) {
+				/* truncated, like wpa_supplicant */
+				nreply = REPLY_SIZE;
+				break;
+			}
+		}
+	} else if (!strcmp(cmd, "BSS")) {
+		handle_bss(args);
+	} else if (!strcmp(cmd, "LIST_NETWORKS")) {
+		reply_printf("network id / ssid / bssid / flags\n");
+		for (j = 0; j < nnetworks; ++j)
+			reply_printf("%i\t%s\tany\t%s\n", networks[j].id, networks[j].ssid,
+					networks[j].disabled ? "[DISABLED]" : "");
+	} else if (!strcmp(cmd, "GET_NETWORK")) {
+		net = find_network(strtoul(strtok(args, " ") ?: "-1", NULL, 0));
+		tok = strtok(NULL, " ") ?: "";
+		if (!net)
+			reply_printf("FAIL\n");
+		else if (!strcmp(tok, "ssid"))
+			reply_printf("\"%s\"", net->ssid);
+		else if (!strcmp(tok, "disabled"))
+			reply_printf("%i", net->disabled);
+		else if (!strcmp(tok, "mode"))
+			reply_printf("%i", net->mode);
+		else
+			reply_printf("FAIL\n");
+	} else if (!strcmp(cmd, "ADD_NETWORK")) {
+		net = add_network("");
+		emit_event("CTRL-EVENT-NETWORK-ADDED %i", net->id);
+		reply_printf("%i\n", net->id);
+	} else if (!strcmp(cmd, "SET_NETWORK")) {
+		net = find_network(strtoul(strtok(args, " ") ?: "-1", NULL, 0));
+		tok = strtok(NULL, " ") ?: "";
+		args = strtok(NULL, "") ?: "";
+		if (!net) {
+			reply_printf("FAIL\n");
+		} else {
+			if (!strcmp(tok, "ssid")) {
+				myfree(net->ssid);
+				if (*args == '"')
+					++args;
+				net->ssid = strdup(args);
+				if (*net->ssid && net->ssid[strlen(net->ssid)-1] == '"')
+					net->ssid[strlen(net->ssid)-1] = 0;
+			} else if (!strcmp(tok, "mode"))
+				net->mode = strtoul(args, NULL, 0);
+			else if (!strcmp(tok, "disabled"))
+				net->disabled = strtoul(args, NULL, 0);
+			reply_printf("OK\n");
+		}
+	} else if (!strcmp(cmd, "ENABLE_NETWORK") || !strcmp(cmd, "DISABLE_NETWORK") ||
+			!strcmp(cmd, "SELECT_NETWORK") || !strcmp(cmd, "REMOVE_NETWORK")) {
+		int all = !strcmp(args ?: "", "all");
+
+		id = strtoul(args ?: "-1", NULL, 0);
+		if (!all && !find_network(id)) {
+			reply_printf("FAIL\n");
+			goto done;
+		}
+		for (j = 0; j < nnetworks; ) {
+			net = networks+j;
+			if (!strcmp(cmd, "SELECT_NETWORK"))
+				net->disabled = net->id != id;
+			else if (!all && net->id != id)
+				;
+			else if (!strcmp(cmd, "ENABLE_NETWORK"))
+				net->disabled = 0;
+			else if (!strcmp(cmd, "DISABLE_NETWORK"))
+				net->disabled = 1;
+			else {
+				emit_event("CTRL-EVENT-NETWORK-REMOVED %i", net->id);
+				remove_network(net);
+				continue;
+			}
+			++j;
+		}
+		reply_printf("OK\n");
+	} else if (!strcmp(cmd, "SAVE_CONFIG") || !strcmp(cmd, "SET")) {
+		reply_printf("OK\n");
+	} else if (!strcmp(cmd, "STA-FIRST") || !strcmp(cmd, "STA-NEXT") || !strcmp(cmd, "STA")) {
+		j = -1;
+		if (!strcmp(cmd, "STA-FIRST"))
+			j = 0;
+		else if (args) {
+			j = find_sta(args);
+			if (j >= 0 && !strcmp(cmd, "STA-NEXT"))
+				++j;
+		}
+		if (apmode && j >= 0 && j < nstas) {
+			stas[j].rxbytes += rand() % 10000;
+			stas[j].txbytes += rand() % 10000;
+			reply_printf("%s\nflags=[AUTH][ASSOC][AUTHORIZED]\n"
+					"rx_bytes=%lu\ntx_bytes=%lu\nsignal=%i\nconnected_time=%li\n",
+					stas[j].mac, stas[j].rxbytes, stas[j].txbytes,
+					stas[j].signal, (long)(time(NULL) - stas[j].since));
+		}
+	} else {
+		reply_printf("UNKNOWN COMMAND\n");
+	}
+done:
+	queue_pkt(addr, addrlen, reply, nreply);
+	++nreplies;
+}
+
+static void sock_recvd(void)
+{
+	static char buf[4096];
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	int ret;
+
+	for (;;) {
+		addrlen = sizeof(addr);
+		ret = recvfrom(sock, buf, sizeof(buf)-1, MSG_DONTWAIT,
+				(struct sockaddr *)&addr, &addrlen);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		if (ret < 0)
+			mylog(LOG_ERR, "recvfrom: %s", ESTR(errno));
+		buf[ret] = 0;
+		handle_cmd(buf, &addr, addrlen);
+	}
+}
+
+/* script execution */
+struct line {
+	struct line *next;
+	char a[1];
+};
+
+static struct line *lines, *lineslast;
+static int scriptfd = -1;
+static int script_busy;
+
+static void add_line(const char *str)
+{
+	struct line *line;
+
+	line = malloc(sizeof(*line)+strlen(str));
+	if (!line)
+		mylog(LOG_ERR, "malloc line: %s", ESTR(errno));
+	strcpy(line->a, str);
+	line->next = NULL;
+	if (lineslast)
+		lineslast->next = line;
+	else
+		lines = line;
+	lineslast = line;
+}
+
+static void print_stats(void)
+{
+	printf("{\"cmds\":%lu,\"replies\":%lu,\"events\":%lu,\"dropped\":%lu,\"bss\":%i}\n",
+			ncmds, nreplies, nevents, ndropped, nbsss - nremoved);
+	fflush(stdout);
+}
+
+static void run_script(void *dat);
+
+/* event storm */
+static int storm_todo, storm_done;
+static double storm_rate, storm_t0;
+
+static void storm_tick(void *dat)
+{
+	struct timespec ts;
+	char ssid[32];
+	double now = mono_now();
+
+	/* pace on the clock, ticks may come late */
+	for (; storm_todo && storm_done < (now - storm_t0)*storm_rate; --storm_todo, ++storm_done) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		sprintf(ssid, "t%lli", ts.tv_sec*1000000000LL + ts.tv_nsec);
+		bss_added(add_bss(ssid, 2412, -60, "[ESS]"));
+	}
+	if (storm_todo) {
+		libt_add_timeout(0.001, storm_tick, dat);
+		return;
+	}
+	run_script(NULL);
+}
+
+static void run_script(void *dat)
+{
+	struct line *line;
+	char *cmd, *arg;
+	struct bss *bss;
+	int j;
+
+	script_busy = 0;
+	while (lines && !sigterm) {
+		line = lines;
+		lines = lines->next;
+		if (!lines)
+			lineslast = NULL;
+
+		cmd = strtok(line->a, " \t");
+		if (!cmd || *cmd == '#')
+			goto next;
+		mylog(LOG_INFO, "script: %s", cmd);
+		if (!strcmp(cmd, "sleep")) {
+			script_busy = 1;
+			libt_add_timeout(strtod(strtok(NULL, " \t") ?: "1", NULL), run_script, NULL);
+			free(line);
+			return;
+		} else if (!strcmp(cmd, "storm")) {
+			storm_todo = strtoul(strtok(NULL, " \t") ?: "1000", NULL, 0);
+			storm_rate = strtod(strtok(NULL, " \t") ?: "1000", NULL);
+			storm_done = 0;
+			storm_t0 = mono_now();
+			script_busy = 1;
+			libt_add_timeout(0, storm_tick, NULL);
+			free(line);
+			return;
+		} else if (!strcmp(cmd, "add")) {
+			char *ssid = strtok(NULL, " \t") ?: "sim";
+			char *freq = strtok(NULL, " \t") ?: "2412";
+			char *level = strtok(NULL, " \t") ?: "-50";
+
+			bss_added(add_bss(ssid, strtoul(freq, NULL, 0), strtol(level, NULL, 0),
+						bssflags[0]));
+		} else if (!strcmp(cmd, "del")) {
+			bss = find_bss(strtok(NULL, " \t") ?: "");
+			if (bss)
+				bss_removed(bss);
+		} else if (!strcmp(cmd, "clear")) {
+			while (nbsss > nremoved) {
+				for (j = nbsss-1; bsss[j].removed; --j);
+				bss_removed(bsss+j);
+			}
+		} else if (!strcmp(cmd, "level")) {
+			bss = find_bss(strtok(NULL, " \t") ?: "");
+			if (bss)
+				bss_level(bss, strtol(strtok(NULL, " \t") ?: "-50", NULL, 0));
+		} else if (!strcmp(cmd, "connect")) {
+			bss = find_bss(strtok(NULL, " \t") ?: "");
+			if (bss) {
+				curr_id = bss->id;
+				sigmon_level = bss->level;
+				emit_event("CTRL-EVENT-CONNECTED - Connection to %s completed [id=0 id_str=]",
+						bss->bssid);
+			}
+		} else if (!strcmp(cmd, "disconnect")) {
+			bss = curr;
+			if (bss)
+				emit_event("CTRL-EVENT-DISCONNECTED bssid=%s reason=3", bss->bssid);
+			curr_id = -1;
+		} else if (!strcmp(cmd, "scan")) {
+			emit_event("CTRL-EVENT-SCAN-RESULTS ");
+		} else if (!strcmp(cmd, "sta-add")) {
+			arg = strtok(NULL, " \t") ?: "";
+			add_sta(arg);
+			emit_event("AP-STA-CONNECTED %s", arg);
+		} else if (!strcmp(cmd, "sta-del")) {
+			arg = strtok(NULL, " \t") ?: "";
+			j = find_sta(arg);
+			if (j >= 0) {
+				remove_sta(j);
+				emit_event("AP-STA-DISCONNECTED %s", arg);
+			}
+		} else if (!strcmp(cmd, "event")) {
+			emit_event("%s", strtok(NULL, "") ?: "");
+		} else if (!strcmp(cmd, "stats")) {
+			print_stats();
+		} else if (!strcmp(cmd, "quit")) {
+			sigterm = 1;
+		} else
+			mylog(LOG_WARNING, "unknown script command '%s'", cmd);
+next:
+		free(line);
+	}
+}
+
+static void script_recvd(void)
+{
+	static char buf[4096];
+	static int fill;
+	char *str, *nl;
+	int ret;
+
+	ret = read(scriptfd, buf+fill, sizeof(buf)-1-fill);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret <= 0) {
+		if (ret < 0)
+			mylog(LOG_WARNING, "read script: %s", ESTR(errno));
+		if (fill) {
+			/* last line without newline */
+			buf[fill] = 0;
+			add_line(buf);
+			fill = 0;
+		}
+		close(scriptfd);
+		scriptfd = -1;
+		goto run;
+	}
+	fill += ret;
+	buf[fill] = 0;
+	for (str = buf; (nl = strchr(str, '\n')) != NULL; str = nl+1) {
+		*nl = 0;
+		add_line(str);
+	}
+	fill -= str - buf;
+	memmove(buf, str, fill);
+	if (fill >= sizeof(buf)-1) {
+		mylog(LOG_WARNING, "script line too long");
+		fill = 0;
+	}
+run:
+	if (!script_busy)
+		run_script(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, ret, j;
+	struct pollfd pf[2];
+	struct sockaddr_un name = {
+		.sun_family = AF_UNIX,
+	};
+
+	/* argument parsing */
+	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) >= 0)
+	switch (opt) {
+	case 'V':
+		fprintf(stderr, "%s %s\nCompiled on %s %s\n",
+				NAME, VERSION, __DATE__, __TIME__);
+		exit(0);
+	case 'v':
+		++loglevel;
+		break;
+	case 'C':
+		ctrldir = optarg;
+		break;
+	case 'i':
+		iface = optarg;
+		break;
+	case 'n':
+		nrandom = strtoul(optarg, NULL, 0);
+		break;
+	case 's':
+		srand(strtoul(optarg, NULL, 0));
+		break;
+	case 'R':
+		random_rate = strtod(optarg, NULL);
+		break;
+	case 'a':
+		apmode = 1;
+		for (j = strtoul(optarg, NULL, 0); j > 0; --j) {
+			char mac[18];
+
+			sprintf(mac, "0a:5e:00:00:%02x:%02x", (j >> 8) & 0xff, j & 0xff);
+			add_sta(mac);
+		}
+		break;
+	case 'q':
+		maxqueue = strtoul(optarg, NULL, 0);
+		break;
+
+	default:
+		fprintf(stderr, "unknown option '%c'", opt);
+	case '?':
+		fputs(help_msg, stderr);
+		exit(1);
+		break;
+	}
+
+	setmylog(NAME, 0, LOG_LOCAL2, loglevel);
+	mysignal(SIGINT, onsigterm);
+	mysignal(SIGTERM, onsigterm);
+
+	if (optind < argc) {
+		if (!strcmp(argv[optind], "-"))
+			scriptfd = STDIN_FILENO;
+		else {
+			scriptfd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+			if (scriptfd < 0)
+				mylog(LOG_ERR, "open %s: %s", argv[optind], ESTR(errno));
+		}
+	}
+
+	/* world */
+	for (j = 0; j < nrandom; ++j)
+		add_random_bss();
+	/* some known networks */
+	for (j = 0; j < 3; ++j) {
+		char ssid[16];
+
+		sprintf(ssid, "net%i", j);
+		add_network(ssid)->disabled = j == 2;
+	}
+
+	/* control socket */
+	mkdir(ctrldir, 0755);
+	ret = snprintf(name.sun_path, sizeof(name.sun_path), "%s/%s", ctrldir, iface);
+	if (ret >= sizeof(name.sun_path))
+		mylog(LOG_ERR, "path %s/%s too long", ctrldir, iface);
+	sock = socket(PF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		mylog(LOG_ERR, "socket unix: %s", ESTR(errno));
+	unlink(name.sun_path);
+	if (bind(sock, (struct sockaddr *)&name, SUN_LEN(&name)) < 0)
+		mylog(LOG_ERR, "bind %s: %s", name.sun_path, ESTR(errno));
+
+	if (random_rate > 0)
+		libt_add_timeout(0.01, random_change, NULL);
+
+	pf[0].fd = sock;
+	pf[1].fd = scriptfd;
+	pf[1].events = POLLIN;
+
+	while (!sigterm) {
+		libt_flush();
+		if (sigterm)
+			break;
+		pf[0].events = POLLIN | (outq ? POLLOUT : 0);
+		pf[1].fd = scriptfd;
+		ret = poll(pf, 2, libt_get_waittime());
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			mylog(LOG_ERR, "poll ...");
+		if (pf[0].revents & POLLOUT)
+			flush_outq();
+		if (pf[0].revents & POLLIN)
+			sock_recvd();
+		if (pf[1].revents)
+			script_recvd();
+	}
+	unlink(name.sun_path);
+	print_stats();
+	return 0;
+}